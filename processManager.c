@@ -1,5 +1,20 @@
+#define _GNU_SOURCE
 #include <pthread.h>
+#include <spawn.h>
+#include <limits.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <unistd.h>
 #include <stdbool.h>
 #include <string.h>
@@ -8,10 +23,47 @@
 #include <stdlib.h>
 #include <ctype.h>
 #include <time.h>
+#include <poll.h>
+#include <getopt.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <search.h>
 
 #define MAX_STR_LEN 512
-#define NUM_COMMANDS 5
-#define MAX_CHILDREN 256
+#define NUM_COMMANDS 11
+#define MAX_NAME_LEN 64
+#define CGROUP_DIR_LEN (PATH_MAX + MAX_NAME_LEN + 12)	//a cgroup root, a slash, a server name and its slot
+#define SLAB_CHUNK 256		//records added each time a slab grows
+#define MAX_ARGS 16
+#define MAX_COUNT 65536
+#define MAX_EVENTS 64
+#define CACHE_LINE 64
+#define MAX_WORKER_SLOTS 65536
+#define STATUS_MAGIC 0x36534d50	//"PMS6"
+#define STATE_MAGIC 0x34545350	//"PST4"
+#define JOURNAL_MAGIC 0x314a4d50	//"PMJ1"
+#define JOURNAL_BUFFER 65536	//bytes of records held for one group commit
+#define CLIENT_OUT_LIMIT (1 << 20)	//replies a client may leave unread before it is not read
+#define SEQ_RETRIES 10000	//reads of a slot before it is taken as torn
+#define HEARTBEAT_MS 250	//how often an idle worker still beats
+#define START_RETRY_MS 10	//wait after a failed worker start, doubled per failure
+#define START_RETRY_MAX_MS 5000
+#define WORKER_EXITS 16	//worker exits a server keeps for the watch feed
+#define THREAD_STACK (128 * 1024)
+#define TASK_DEQUES 64
+#define TASK_DEQUE_SIZE 1024	//power of two
+#define HIST_SUB_BITS 4		//16 buckets per power of two, about 6% wide
+#define HIST_MAX_BITS 40	//values up to about 18 minutes in ns
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+#ifndef SYS_close_range
+#define SYS_close_range 436
+#endif
 
 
 /**********************************************************************
@@ -29,301 +81,6444 @@
  * Author: John Tunisi
  *********************************************************************/
 
+/**********************************************************************
+ * Something the event loop waits on. Each epoll entry points at one
+ * of these, so a ready pidfd leads straight to the child it watches.
+ *********************************************************************/
+enum sourceType {SRC_INPUT, SRC_SIGNALS, SRC_CHANNEL, SRC_SERVER, SRC_WORKER, SRC_TIMER, SRC_DEADLINE, SRC_LISTEN, SRC_WATCH,
+	SRC_CONTROL, SRC_CLIENT};
+
+struct eventSource{
+	enum sourceType type;
+	void *owner;
+};
+
+/**********************************************************************
+ * A log-linear latency histogram in the style of HdrHistogram. Each
+ * power of two of nanoseconds is split into 2^HIST_SUB_BITS equal
+ * buckets, so every recorded value is kept to within about 6% at any
+ * scale, and recording is a few shifts and an increment.
+ *
+ * Every process keeps its own set: the first NUM_COMMANDS are the
+ * branches of parseCommand, and the rest time the system calls behind
+ * them. The exit entries run from the kill to the reap, so they cover
+ * signal delivery, the child's shutdown and the wakeup of its parent.
+ *********************************************************************/
+enum statId {STAT_FORK_SERVER = NUM_COMMANDS, STAT_KILL_SERVER, STAT_WAIT_SERVER, STAT_SERVER_EXIT,
+	STAT_START_WORKER, STAT_PROMOTE_WORKER, STAT_KILL_WORKER, STAT_WAIT_WORKER, STAT_WORKER_EXIT,
+	NUM_STATS};
+
+struct histogram{
+	unsigned long long count;
+	unsigned long long sum;
+	unsigned long long min;
+	unsigned long long max;
+	unsigned int buckets[HIST_BUCKETS];
+};
+
+/**********************************************************************
+ * Resources used by a worker, or summed over a server's workers. A
+ * live worker's figures come from /proc and an exited worker's from
+ * the rusage that wait4 hands back when it is reaped.
+ *********************************************************************/
+struct usage{
+	unsigned long long userUsec;
+	unsigned long long sysUsec;
+	long maxRss;	//KB, the largest of any worker when summed
+	long minFaults;
+	long majFaults;
+	long volSwitches;
+	long involSwitches;
+};
+
+/**********************************************************************
+ * What the watch feed last reported for a server, so that each tick
+ * only reports what has changed since
+ *********************************************************************/
+struct watchSnapshot{
+	pid_t pid;
+	int numWorkers;
+	int numSpares;
+	int queued;
+	int running;
+	unsigned long long submitted;
+	unsigned long long done;
+};
+
+/**********************************************************************
+ * A reaped worker, kept by its server in a ring of the last
+ * WORKER_EXITS so the manager's watch feed can report it
+ *********************************************************************/
+struct workerExit{
+	unsigned long long time;	//wall-clock milliseconds
+	pid_t pid;
+	int status;	//wait status, 0 for a thread
+	bool lost;	//it was active, not a spare or retired
+};
+
+/**********************************************************************
+ * A worker owned by a server. Each server keeps its own lists so
+ * per-server operations never touch other servers' workers. A retired
+ * worker stays on the retiring list until it is reaped.
+ *
+ * A thread worker's pid is its thread id, and pidFd is an eventfd the
+ * thread writes as it finishes. The fields below the thread handle are
+ * shared with the thread and guarded by threadLock.
+ *********************************************************************/
+enum workerState {SPARE, ACTIVE, RETIRING};
+
+struct worker{
+	pid_t pid;
+	int pidFd;
+	enum workerState state;
+	int index;
+	int target;
+	int slot;
+	unsigned long long cpuTicks;
+	bool cpuSampled;
+	struct usage usage;
+	unsigned long long killedAt;
+	unsigned long long lastBeat;
+	unsigned long long beatAt;
+	bool forced;
+	struct eventSource exitSource;
+	int deque;
+	pthread_t thread;
+	bool promoted;
+	bool stopping;
+	struct rusage exitUsage;
+	int exitStatus;
+	struct worker *prev;
+	struct worker *next;
+};
+
+/**********************************************************************
+ * How a server runs its workers. Every worker operation goes through
+ * its server's backend:
+ * 	start()		fills in the worker record; false if it failed
+ * 	promote()	wakes a spare
+ * 	stop()		asks a worker to exit
+ * 	reap()		collects an exited worker, its final usage and its
+ * 				wait status in exitStatus; false if it has not
+ * 				exited and block is false
+ *
+ * 	fork	the worker is a copy of the server
+ * 	spawn	the worker execs a fresh image of this program through
+ * 			posix_spawn, which glibc runs as clone(CLONE_VM|
+ * 			CLONE_VFORK), so the server's page tables are never copied
+ * 	thread	the worker is a thread inside the server, costing a small
+ * 			stack instead of a process
+ *********************************************************************/
+struct workerBackend{
+	const char *name;
+	bool threads;
+	bool (*start)(struct worker *w, bool spare);
+	void (*promote)(struct worker *w);
+	void (*stop)(struct worker *w);
+	bool (*reap)(struct worker *w, struct rusage *ru, bool block);
+};
+
+/**********************************************************************
+ * Settings given to createserver. Anything after the server name is
+ * an OPTION=VALUE pair:
+ * 	spares=N		keep N pre-forked idle workers ready for promotion
+ * 	backend=NAME	run workers with the fork, spawn or thread backend
+ * 	autoscale=SIG	grow and shrink between min and max on a load
+ * 					signal: cpu (CPU used per worker, 1.0 is one
+ * 					core), queue (tasks queued or running per
+ * 					worker) or file:PATH (a number in PATH, divided
+ * 					by the worker count)
+ * 	scaleup=X		grow when the per-worker load is above X
+ * 	scaledown=X		shrink when it is below X
+ * 	interval=MS		how often the load and resource usage are
+ * 					sampled
+ * 	cooldown=SEC	how long to hold after any scaling step
+ * 	cpumax=Q/P		allow Q microseconds of CPU every P (cpu.max)
+ * 	memmax=BYTES	cap memory, with an optional K, M or G suffix
+ * 	pidsmax=N		cap the number of tasks in the server's cgroup
+ * 					(the three limits need -c; each also takes max)
+ * 	placement=P		bind workers to CPUs: pin:LIST gives each worker
+ * 					one CPU of LIST (e.g. 0-3,8), spread shares them
+ * 					out over the NUMA nodes and pack keeps them all
+ * 					on the server's node; new workers go where the
+ * 					fewest are
+ * 	heartbeat=MS	replace an active worker whose heartbeat has not
+ * 					moved for MS (default 5000, 0 turns it off);
+ * 					checked every interval
+ * 	drain=MS		how long a retired worker may take to finish the
+ * 					task it is running before it is killed (default
+ * 					10000); checked every interval
+ * 	spawnrate=R[/B]	start at most R workers a second, in bursts of up
+ * 					to B (default R); starts over the limit, and over
+ * 					the global -r limit, wait in a queue. Promoting
+ * 					a spare is not limited.
+ *********************************************************************/
+enum scaleSignal {SCALE_NONE, SCALE_CPU, SCALE_FILE, SCALE_QUEUE};
+enum placeMode {PLACE_NONE, PLACE_PIN, PLACE_SPREAD, PLACE_PACK};
+
+struct serverConfig{
+	int minProcs;
+	int maxProcs;
+	int spares;
+	const struct workerBackend *backend;
+	enum scaleSignal autoscale;
+	char loadFile[MAX_STR_LEN];
+	double scaleUp;
+	double scaleDown;
+	int interval;
+	int cooldown;
+	char cpuMax[32];
+	char memMax[32];
+	char pidsMax[32];
+	enum placeMode placement;
+	cpu_set_t pinSet;
+	int heartbeat;
+	int drain;
+	int spawnRate;
+	int spawnBurst;
+	bool persistent;
+};
+
+/**********************************************************************
+ * A token bucket limiting how fast workers are started, kept as the
+ * time at which the bucket would next be full (the generic cell rate
+ * algorithm): each token pushes tat on by cost, and a start is allowed
+ * while tat stays within burst tokens of now. A single word updated by
+ * compare-and-swap, so servers share the global bucket without a lock.
+ * A cost of 0 means no limit.
+ *********************************************************************/
+struct tokenBucket{
+	unsigned long long tat;
+	unsigned long long cost;	//nanoseconds per token
+	unsigned long long burst;
+};
+
+/**********************************************************************
+ * A server record. The manager keeps one per server in the registry;
+ * the forked server process keeps its own copy as "self".
+ *
+ * Spares are forked ahead of time and wait to be promoted, so a
+ * createprocess served from the pool costs a signal instead of a fork.
+ *********************************************************************/
+struct server{
+	char name[MAX_NAME_LEN];
+	pid_t pid;
+	struct serverConfig config;
+	int numWorkers;
+	int numSpares;
+	int poolHits;
+	int poolMisses;
+	int slot;
+	int cmdFd;
+	int pidFd;
+	int timerFd;
+	double load;
+	unsigned long long lastSample;
+	unsigned long long lastScale;
+	struct usage reaped;
+	struct usage usage;
+	unsigned long long killedAt;
+	unsigned long long submitted;
+	unsigned long long rejected;
+	int replaced;
+	int queuedStarts;
+	int startFailures;	//in a row; starts wait until retryAt
+	unsigned long long retryAt;
+	struct workerExit exits[WORKER_EXITS];
+	unsigned int numExits;	//ever, so exits[numExits % WORKER_EXITS] is next
+	unsigned int exitsSeen;	//by the manager's watch feed
+	struct tokenBucket spawnBucket;
+	int nextDeque;
+	int numTargets;
+	cpu_set_t *targets;
+	int *targetLoad;
+	int dequeUsers[TASK_DEQUES];
+	int batchEntry;
+	bool dying;
+	bool escalated;
+	bool cgroup;
+	bool adopted;
+	unsigned long long startTime;
+	bool watchSeen;
+	struct watchSnapshot watched;
+	struct eventSource exitSource;
+	struct worker *workers;
+	struct worker *spares;
+	struct worker *retiring;
+	struct server *prev;
+	struct server *next;
+};
+
+/**********************************************************************
+ * A typed message sent from the manager to a server over its command
+ * channel. One message can ask for any number of workers, so a burst
+ * of scaling commands is neither coalesced nor sent one at a time.
+ * arg carries the task cost for MSG_SUBMIT. MSG_ATTACH carries the
+ * manager's stdout as an SCM_RIGHTS descriptor.
+ *********************************************************************/
+enum msgType {MSG_SPAWN, MSG_RETIRE, MSG_STATS, MSG_RESET_STATS, MSG_SUBMIT, MSG_REBALANCE, MSG_ATTACH};
+
+struct serverMsg{
+	int type;
+	int count;
+	int arg;
+};
+
+/**********************************************************************
+ * A server's task pool, in a shared memfd mapping that fork and thread
+ * workers inherit and spawn workers map from the descriptor they are
+ * started with. Every worker has a home deque (workers share deques
+ * past TASK_DEQUES). The server pushes submitted tasks round-robin
+ * onto the deques in use; a worker pops the newest task from its own
+ * deque and, when that is empty, steals the oldest from a sibling's.
+ *
+ * pending counts tasks not yet taken, so idle workers sleep in
+ * sem_wait. A wakeup that finds nothing is simply dropped, which is
+ * what lets the server post extra wakeups when it finds tasks with no
+ * count behind them (a worker killed just after sem_wait returned).
+ * Stopping a thread worker also posts a wakeup and counts it in
+ * stopsPending; until the stopping thread takes it, anyone else who
+ * finds nothing hands the wakeup on.
+ *********************************************************************/
+struct task{
+	unsigned long long submitted;
+	unsigned int costUsec;
+};
+
+struct taskDeque{
+	pthread_mutex_t lock;
+	unsigned int top;		//thieves take from here
+	unsigned int bottom;	//the home side pushes and pops here
+	int running;
+	unsigned long long done;
+	unsigned long long stolen;
+	struct task tasks[TASK_DEQUE_SIZE];
+} __attribute__((aligned(CACHE_LINE)));
+
+struct taskPool{
+	sem_t pending;
+	int stopsPending;
+	struct taskDeque deques[TASK_DEQUES];
+};
+
+/**********************************************************************
+ * Shared status segment. The manager maps it at start-up and every
+ * server inherits it; outside tools can map it read-only from
+ * /dev/shm/processManager.<manager pid>. Each server and worker has
+ * its own cache-line-aligned slot, written only by the server that
+ * owns it and guarded by a sequence counter: the writer makes seq odd,
+ * updates the slot and makes seq even again, and a reader copies the
+ * slot until it sees the same even seq before and after. Nothing ever
+ * takes a lock, so reads never hold up a server.
+ *
+ * A worker slot is claimed by swapping owner from 0 to the server's
+ * slot number + 1, so servers can claim slots without the manager.
+ * The server slots come last so the manager can grow the segment as
+ * servers are added; numServerSlots says how far a reader may look.
+ * A server only ever touches its own slot, which was already mapped
+ * when it was forked.
+ *
+ * The header's spawn bucket is taken from by every server, always by
+ * compare-and-swap. The other exceptions to a single writer are a
+ * worker slot's beats and busy, which the worker itself writes: it
+ * bumps beats at least every HEARTBEAT_MS while it is active, and its
+ * server counts a worker whose beats stop as hung; busy is set while
+ * it runs a task.
+ *********************************************************************/
+struct statusHeader{
+	unsigned int magic;
+	unsigned int numServerSlots;
+	unsigned int numWorkerSlots;
+	pid_t managerPid;
+	struct tokenBucket spawnBucket;	//the -r limit, shared by all servers
+} __attribute__((aligned(CACHE_LINE)));
+
+struct serverSlot{
+	unsigned int seq;
+	int inUse;
+	pid_t pid;
+	int minProcs;
+	int maxProcs;
+	int numWorkers;
+	int numSpares;
+	int spares;
+	int poolHits;
+	int poolMisses;
+	double load;
+	struct usage usage;
+	int queued;
+	int running;
+	unsigned long long submitted;
+	unsigned long long done;
+	unsigned long long stolen;
+	char backend[8];
+	char placement[8];
+	int targets;
+	int replaced;
+	int queuedStarts;
+	unsigned int numExits;
+	struct workerExit exits[WORKER_EXITS];
+	int firstOwned;	//its worker slots, linked by nextOwned, as slot + 1
+	char name[MAX_NAME_LEN];
+} __attribute__((aligned(CACHE_LINE)));
+
+struct workerSlot{
+	unsigned int seq;
+	int owner;
+	pid_t pid;
+	int state;
+	int inflight;
+	struct usage usage;
+	unsigned long long beats;	//written by the worker itself, outside seq
+	int busy;
+	int prevOwned;	//the owner's other slots, as slot + 1, 0 for none
+	int nextOwned;
+} __attribute__((aligned(CACHE_LINE)));
+
+struct statusTable{
+	struct statusHeader header;
+	struct workerSlot workers[MAX_WORKER_SLOTS];
+	struct serverSlot servers[];
+};
+
+/**********************************************************************
+ * Open-addressing hash of server name to server record. Empty slots
+ * are NULL, removed slots hold the tombstone so probe chains survive.
+ * The table doubles, dropping its tombstones, before it is half full.
+ *********************************************************************/
+struct registry{
+	struct server **slots;
+	int size;	//power of two
+	int count;
+	int tombstones;
+};
+
+/**********************************************************************
+ * The registry as saved to the -s state file: a header, then one
+ * record per server. A server is known again by its pid together
+ * with its start time, so a reused pid is never mistaken for it.
+ *********************************************************************/
+struct stateHeader{
+	unsigned int magic;
+	unsigned int recordSize;
+	int count;
+	char statusName[64];
+};
+
+struct stateRecord{
+	char name[MAX_NAME_LEN];
+	pid_t pid;
+	unsigned long long startTime;
+	int slot;
+	int backend;
+	bool cgroup;
+	struct serverConfig config;	//backend pointer not used
+};
+
+/**********************************************************************
+ * The -j command journal: JOURNAL_MAGIC, then one record per accepted
+ * command, each a header followed by the command's words joined by
+ * single spaces. crc is the CRC-32 of time and the text, so a record
+ * torn by a crash is found and cut off when the journal is reopened.
+ *********************************************************************/
+struct journalRecord{
+	unsigned long long time;	//wall-clock nanoseconds
+	unsigned int length;
+	unsigned int crc;
+};
+
+/**********************************************************************
+ * A server as the journal leaves it, for replay: the createserver
+ * line that made it and how many workers it has above its minimum
+ *********************************************************************/
+struct replayServer{
+	char line[MAX_STR_LEN];
+	int extra;
+	int room;	//maxProcs - minProcs, the most extra can be
+	bool live;
+};
+
+/**********************************************************************
+ * Fixed-size records handed out from chunks that never move, so a
+ * record's address stays valid however far the slab grows. Freed
+ * records go on a LIFO free list and are reused first, while they
+ * are still warm in the cache. A record's index is stable as well.
+ *********************************************************************/
+struct slab{
+	size_t recordSize;
+	char **chunks;
+	int numChunks;
+	int used;
+	int *freeList;
+	int numFree;
+	int freeCapacity;
+};
+
+/**********************************************************************
+ * One command run in batch mode. An abortserver entry stays pending
+ * until the event loop reaps its server.
+ *********************************************************************/
+struct batchEntry{
+	int line;
+	char text[MAX_STR_LEN];
+	bool ok;
+	bool pending;
+	unsigned long long start;
+	unsigned long long end;
+};
+
+/**********************************************************************
+ * Bytes read from stdin that do not yet make up a whole line
+ *********************************************************************/
+struct lineBuffer{
+	char data[MAX_STR_LEN];
+	int len;
+	bool discarding;
+};
+
+/**********************************************************************
+ * A connection to the -S control socket. Lines are taken from in
+ * exactly as stdin's are and each one gets a reply, in order, queued
+ * in out until the client reads it:
+ * 	ok|failed LENGTH\n
+ * followed by LENGTH bytes of whatever the command printed.
+ *********************************************************************/
+struct client{
+	int fd;
+	struct eventSource source;
+	struct lineBuffer in;
+	char *out;
+	size_t outLen;
+	size_t outSent;
+	size_t outSize;
+	bool closing;
+	struct client *prev;
+	struct client *next;
+};
+
+enum role {MANAGER, SERVER, WORKER};
+
 void sighandler(int signum);
-void createServer(char * serverName, int minProcs, int maxProcs);
-void abortServer(char * serverName);
+bool createServer(char * serverName, struct serverConfig *cfg);
+bool abortServer(char * serverName);
 void createProcess();
+void activateWorker(struct worker *w);
+struct worker *startWorker(bool spare);
+bool parseRate(const char *str, int *rate, int *burst);
+void setBucket(struct tokenBucket *b, int rate, int burst);
+unsigned long long bucketWait(struct tokenBucket *b, unsigned long long now);
+bool takeToken(struct tokenBucket *b, unsigned long long now);
+bool takeSpawnToken();
+int spawnWait();
+void startFailed();
+void startQueued();
+bool forkStart(struct worker *w, bool spare);
+bool spawnStart(struct worker *w, bool spare);
+void signalPromote(struct worker *w);
+void signalStop(struct worker *w);
+bool waitReap(struct worker *w, struct rusage *ru, bool block);
+bool threadStart(struct worker *w, bool spare);
+void *workerThread(void *arg);
+void threadPromote(struct worker *w);
+void threadStop(struct worker *w);
+bool threadReap(struct worker *w, struct rusage *ru, bool block);
+void workerProcDir(struct worker *w, char *dir, size_t len);
+bool parseCpuList(const char *str, cpu_set_t *set);
+bool readCpuList(const char *path, cpu_set_t *set);
+void setupPlacement();
+int pickTarget();
+void applyPlacement(pid_t pid, int target);
+void rebalance();
+const struct workerBackend *findBackend(const char *name);
+void workerMain(bool spare, int deque);
+void waitForPromotion();
+void compareSpawn(int count, int heapMegs);
 void abortProcess();
+struct worker *pickVictim();
+int workerLoad(struct worker *w);
+void retireWorker(struct worker *w);
+void checkDrains();
 void displayStatus();
 bool parseCommand(char * command);
+bool runCommand(int argc, char **argv);
+bool parseCount(const char *str, int *value);
+bool parseServerOptions(struct serverConfig *cfg, char **opts, int numOpts);
+bool parseFraction(const char *str, double *value);
+bool readCommand(FILE *in, char *command);
+int runBatch(FILE *in);
+int runBenchmark(int reps);
+bool benchCommand(const char *format, ...);
+bool waitForWorkers(const char *name, int count);
+int compareNanos(const void *a, const void *b);
+void reportLatency(FILE *out, const char *op, int workers, unsigned long long *samples, int n);
+unsigned long long nowNanos();
+bool sendMessage(struct server *s, int type, int count, int arg);
+bool createTaskPool();
+bool mapTaskPool(int fd);
+int claimDeque();
+void submitTasks(int count, int costUsec);
+bool pushTask(struct taskDeque *d, const struct task *t);
+bool takeTask(int deque, struct task *t);
+void runTasks(int deque, struct worker *w);
+void runTask(struct taskDeque *home, const struct task *t);
+void countTasks(int *queued, int *running, unsigned long long *done, unsigned long long *stolen);
+int dequeInflight(int deque);
+void wakeOrphans();
+void heartbeat(struct worker *w);
+struct workerSlot *ownSlot(struct worker *w);
+void mapBeatSlot(const char *name, int slot);
+void checkHeartbeats();
+void replaceWorker(struct worker *w);
+void serverLoop();
+bool createStatusTable();
+void removeStatusTable();
+void seqBegin(unsigned int *seq);
+void seqEnd(unsigned int *seq);
+bool seqRead(void *dst, const void *slot, size_t len);
+void publishServer();
+void publishWorker(struct worker *w);
+int claimWorkerSlot();
+void releaseWorkerSlot(struct worker *w);
+void releaseServerSlot(struct server *s);
+bool growStatusTable(unsigned int numSlots);
+void *slabAlloc(struct slab *sl, int *index);
+void *slabAllocAt(struct slab *sl, int index);
+bool growSlab(struct slab *sl);
+void slabFree(struct slab *sl, int index);
+void *slabRecord(struct slab *sl, int index);
+struct server *findServer(const char *name);
+bool growRegistry(int size);
+struct server *addServer(const char *name, int slot);
+void removeServer(struct server *s);
+void freeServer(struct server *s);
+bool setupEvents();
+bool watchFd(int fd, struct eventSource *src);
+void watchChild(pid_t pid, int *pidFd, struct eventSource *src);
+void unwatchChild(int *pidFd);
+int pollEvents(int timeout);
+void readInput();
+void takeLines(struct lineBuffer *b, struct client *c);
+bool openControl(const char *path);
+void acceptClients();
+void readClient(struct client *c);
+void clientCommand(struct client *c, char *line);
+void queueReply(struct client *c, bool ok, const char *body, size_t len);
+void writeClient(struct client *c);
+void closeClient(struct client *c);
+void restoreConsole();
+void readSignals();
+void readMessage();
+void serverExited(struct server *s);
+void workerExited(struct worker *w);
+void sweepUnwatched();
+void stopManager();
+void stopServer();
+void armDeadline();
+void escalateStops();
+bool reapChildren(unsigned long long deadline);
+void stopServers();
+void killServer(struct server *s);
+bool setupCgroups(const char *root);
+bool createCgroup(struct server *s);
+void removeCgroup(struct server *s);
+void cgroupDir(struct server *s, char *dir, size_t len);
+bool writeCgroup(const char *dir, const char *file, const char *value);
+bool readCgroup(const char *dir, const char *file, const char *key, unsigned long long *value);
+bool validLimit(const char *value, const char *suffixes);
+void saveState();
+bool restoreState();
+bool openStatusTable(const char *name);
+bool adoptServer(const struct stateRecord *r);
+bool readStartTime(pid_t pid, unsigned long long *startTime);
+socklen_t serverAddress(pid_t pid, struct sockaddr_un *addr);
+bool listenForManager();
+void acceptManager();
+bool sendAttach(struct server *s);
+bool serverRunning(struct server *s);
+bool openJournal(const char *path);
+void journalCommand(const char *text);
+void flushJournal();
+bool readRecord(FILE *f, struct journalRecord *r, char *text);
+unsigned int journalCrc(unsigned int crc, const void *data, size_t len);
+bool dumpJournal(const char *path);
+bool replayJournal(const char *path);
+bool startWatch(int interval, const char *file);
+void stopWatch();
+void watchTick();
+void watchExit(struct server *s, int status);
+void jsonString(FILE *out, const char *str);
+unsigned long long wallMillis();
+void closeInheritedFds(int keep);
+bool startTimer(int interval);
+void serverTick();
+bool sampleLoad(double *load);
+bool readCpuTicks(const char *dir, unsigned long long *ticks);
+void sampleUsage();
+bool readUsage(const char *dir, struct usage *u);
+void addUsage(struct usage *total, const struct usage *u);
+void addRusage(struct usage *total, const struct rusage *ru);
+void autoscale();
+void listPush(struct worker **head, struct worker *w);
+void listRemove(struct worker **head, struct worker *w);
+void recordStat(int id, unsigned long long nanos);
+int histBucket(unsigned long long value);
+unsigned long long bucketValue(int bucket);
+unsigned long long histPercentile(const struct histogram *h, int permille);
+void printStats();
+void resetStats();
 
 int numActive;
-int numProcesses;
-int totalServers;
-pid_t childPid[MAX_CHILDREN];
-char *childName[MAX_CHILDREN];
 pthread_mutex_t lock;
-int min_processes;
-int max_processes;
-char *myName;
-char *serverList[MAX_CHILDREN];
+enum role role;
+struct registry servers;
+struct server tombstone;
+struct server *self;
+bool batchMode;
+struct batchEntry *batchEntries;
+struct batchEntry *currentEntry;
+int numPending;
+int epollFd;
+int signalFd;
+int numUnwatched;
+bool inputClosed;
+struct lineBuffer input;
+struct eventSource inputSource = {SRC_INPUT, NULL};
+struct eventSource signalSource = {SRC_SIGNALS, NULL};
+struct eventSource channelSource = {SRC_CHANNEL, NULL};
+struct eventSource timerSource = {SRC_TIMER, NULL};
+struct eventSource deadlineSource = {SRC_DEADLINE, NULL};
+int deadlineFd = -1;
+int killGrace = 5000;
+int spawnRate;
+int spawnBurst;
+int controlFd = -1;
+char controlPath[sizeof(((struct sockaddr_un *)0)->sun_path)];
+struct eventSource controlSource = {SRC_CONTROL, NULL};
+struct client *clients;
+struct client *commandClient;
+bool detached;
+FILE *console;
+FILE *consoleErr;
+int journalFd = -1;
+char journalBuf[JOURNAL_BUFFER];
+size_t journalLen;
+bool journalMuted;
+char cgroupRoot[PATH_MAX];
+char stateFile[PATH_MAX];
+bool stateDirty;
+int listenFd = -1;
+struct eventSource listenSource = {SRC_LISTEN, NULL};
+struct eventSource watchSource = {SRC_WATCH, NULL};
+int watchTimer = -1;
+FILE *watchOut;
+struct server *dyingServers;
+struct statusTable *status;
+char statusName[64];
+int statusFd = -1;
+struct workerSlot *beatSlot;
+struct slab serverSlab = {.recordSize = sizeof(struct server)};
+struct slab workerSlab = {.recordSize = sizeof(struct worker)};
+int workerSlotHint;
+char workerImage[PATH_MAX];
+extern char **environ;
+struct histogram stats[NUM_STATS];
+pthread_mutex_t threadLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t threadWake = PTHREAD_COND_INITIALIZER;
+struct taskPool *taskPool;
+int taskFd = -1;
+volatile sig_atomic_t taskBusy;
+volatile sig_atomic_t stopRequested;
+
+const char *commandList[NUM_COMMANDS] = {"createserver", "createprocess", "abortserver", "abortprocess",
+	"displaystatus", "comparespawn", "stats", "submit", "rebalance", "detach", "watch"};
+const char *statNames[NUM_STATS] = {"createserver", "createprocess", "abortserver", "abortprocess",
+	"displaystatus", "comparespawn", "stats", "submit", "rebalance", "detach", "watch", "fork server", "kill server", "wait server", "server exit",
+	"start worker", "promote worker", "kill worker", "wait worker", "worker exit"};
+
+const struct workerBackend backends[] = {
+	{"fork", false, forkStart, signalPromote, signalStop, waitReap},
+	{"spawn", false, spawnStart, signalPromote, signalStop, waitReap},
+	{"thread", true, threadStart, threadPromote, threadStop, threadReap}
+};
+#define NUM_BACKENDS (int)(sizeof(backends) / sizeof(backends[0]))
 
 
 /**********************************************************************
  * Main method used for the execution of the Process Management
  * System.
+ *
+ * Usage:	processManager [-b <FILE|->] [-B <REPS>] [-k <MS>] [-c <DIR>]
+ * 			[-s <FILE>] [-r <RATE[/BURST]>] [-j <FILE>] [-R <FILE>]
+ * 			[-J <FILE>] [-S <SOCKET>]
+ * 			-b runs the commands in FILE (or stdin for -) as a batch
+ * 			   and prints a completion summary. Interactive commands
+ * 			   are read from stdin afterwards.
+ * 			-B runs the control-plane benchmark and exits.
+ * 			-k sets how long a stopping server and its workers get
+ * 			   after SIGTERM before they are killed (default 5000).
+ * 			-c puts each server in its own cgroup under DIR, a cgroup
+ * 			   v2 directory delegated to the manager. The manager
+ * 			   itself must live outside DIR.
+ * 			-s keeps the registry in FILE. Servers then outlive the
+ * 			   manager, and a manager started with the same FILE
+ * 			   adopts those still running instead of restarting
+ * 			   them. detach exits on purpose, leaving them running.
+ * 			-r caps worker starts across all servers at RATE a second,
+ * 			   with up to BURST at once (default RATE).
+ * 			-j appends every accepted command to the journal FILE.
+ * 			-R rebuilds the server layout the journal FILE describes
+ * 			   before reading commands. It may name the -j journal.
+ * 			-J prints the commands in the journal FILE and exits.
+ * 			-S also takes commands from clients of the Unix socket
+ * 			   SOCKET, answering each with ok or failed and its output.
+ * 			-w <worker|spare>[:DEQUE:FD] is used internally by the spawn
+ * 			   backend to start this image as a worker, with the
+ * 			   server's task pool open on FD.
  *********************************************************************/
-int main(){
-	signal(SIGINT, sighandler);
-	signal(SIGUSR1, sighandler);
-	signal(SIGUSR2, sighandler);
-	char * command;
+int main(int argc, char *argv[]){
+	char *batchFile = NULL;
+	int benchReps = 0;
 	numActive = 0;
-	numProcesses = 0;
-	totalServers = 0;
-	min_processes = -1;
-	max_processes = -1;
+	role = MANAGER;
+	self = NULL;
 	srand(time(NULL));
 
+	int opt;
+	char *journalFile = NULL, *replayFile = NULL, *controlFile = NULL;
+	console = stdout;
+	consoleErr = stderr;
+	while((opt = getopt(argc, argv, "b:B:k:c:s:r:j:R:J:S:w:")) != -1){
+		if(opt == 'b'){
+			batchFile = optarg;
+		}
+		else if(opt == 'B'){
+			if(!parseCount(optarg, &benchReps) || benchReps == 0){
+				fprintf(stderr, "-B needs a repetition count\n");
+				return 1;
+			}
+		}
+		else if(opt == 'k'){
+			if(!parseCount(optarg, &killGrace)){
+				fprintf(stderr, "-k needs a number of milliseconds\n");
+				return 1;
+			}
+		}
+		else if(opt == 'c'){
+			if(!setupCgroups(optarg)){
+				return 1;
+			}
+		}
+		else if(opt == 'r'){
+			if(!parseRate(optarg, &spawnRate, &spawnBurst)){
+				fprintf(stderr, "-r needs a rate of starts per second, as RATE[/BURST]\n");
+				return 1;
+			}
+		}
+		else if(opt == 'j'){
+			journalFile = optarg;
+		}
+		else if(opt == 'R'){
+			replayFile = optarg;
+		}
+		else if(opt == 'S'){
+			controlFile = optarg;
+		}
+		else if(opt == 'J'){
+			return dumpJournal(optarg) ? 0 : 1;
+		}
+		else if(opt == 's'){
+			if(strlen(optarg) >= sizeof(stateFile) - 8){
+				fprintf(stderr, "-s: path too long\n");
+				return 1;
+			}
+			strcpy(stateFile, optarg);
+		}
+		else if(opt == 'w'){
+			int deque = -1, fd, slot = -1;
+			char table[64];
+			char *pool = strchr(optarg, ':');
+			int fields = pool ? sscanf(pool, ":%d:%d:%d:%63s", &deque, &fd, &slot, table) : 0;
+			if(fields < 2 || fd < 0 || !mapTaskPool(fd)){
+				deque = -1;
+			}
+			if(fields == 4 && slot >= 0 && slot < MAX_WORKER_SLOTS){
+				mapBeatSlot(table, slot);
+			}
+			workerMain(!strncmp(optarg, "spare", 5), deque);
+		}
+		else{
+			fprintf(stderr, "Usage: %s [-b <FILE|->] [-B <REPS>] [-k <MS>] [-c <DIR>] [-s <FILE>] [-r <RATE[/BURST]>]"
+					" [-j <FILE>] [-R <FILE>] [-J <FILE>] [-S <SOCKET>]\n", argv[0]);
+			return 1;
+		}
+	}
+
 	if(pthread_mutex_init(&lock, NULL) != 0){
 		printf("mutex failed init\n");
 		return 1;
 	}
 
-	while(1){
-		command = (char *)malloc(MAX_STR_LEN * sizeof(char));
-		fgets(command, MAX_STR_LEN, stdin); 
-		if(!parseCommand(command)){
-			continue;
-		}
+	ssize_t len = readlink("/proc/self/exe", workerImage, sizeof(workerImage) - 1);
+	if(len < 0){
+		perror("readlink");
+		return 1;
 	}
-	free(command);
-	return 0;
-}
+	workerImage[len] = '\0';
 
+	//one pidfd per child, so allow as many descriptors as we may
+	struct rlimit files;
+	if(getrlimit(RLIMIT_NOFILE, &files) == 0 && files.rlim_cur < files.rlim_max){
+		files.rlim_cur = files.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &files);
+	}
 
-/**********************************************************************
- * Parses the command received from the user
- *
- * Params:	cmd:	The string of characters inputted by the user
- *********************************************************************/
-bool parseCommand(char * cmd){
-	strtok(cmd, "\n");
-	char *pch = strtok(cmd, " ");
-	char *commandList[NUM_COMMANDS] = {"createserver", "createprocess", "abortserver", "abortprocess", "displaystatus"};
+	if(!setupEvents() || !(stateFile[0] != '\0' ? restoreState() : createStatusTable())){
+		return 1;
+	}
+	setBucket(&status->header.spawnBucket, spawnRate, spawnBurst);
+	if(journalFile != NULL && !openJournal(journalFile)){
+		removeStatusTable();
+		return 1;
+	}
+	if(replayFile != NULL && !replayJournal(replayFile)){
+		stopServers();
+		removeStatusTable();
+		return 1;
+	}
+	//a child forked in the middle of a client's command must not keep
+	//writing into that client's reply
+	pthread_atfork(NULL, NULL, restoreConsole);
+	if(controlFile != NULL && !openControl(controlFile)){
+		removeStatusTable();
+		return 1;
+	}
 
-	//help	
-	if(strstr(cmd, "-help")){
-		char *commandArgs[NUM_COMMANDS] = {"<MIN_PROCESSES> <MAX_PROCESSES> <SERVERNAME>",
-			"<SERVERNAME>", "<SERVERNAME>", "<SERVERNAME>", "<NONE>"};
-		printf("Commands list:\n");
-		int i;
-		for(i = 0; i < NUM_COMMANDS; i++){
-			printf("%s\t%s\n", commandList[i], commandArgs[i]);
-		}
+	if(benchReps > 0){
+		int failed = runBenchmark(benchReps);
+		removeStatusTable();
+		return failed ? 1 : 0;
 	}
-	//createserver
-	else if(!strcmp(cmd, commandList[0])){
-		int minProcs, maxProcs;
-		char * serverName;
-		pch = strtok(NULL, " ");
-		if(pch != NULL){
-			minProcs = atoi(pch);
-		}
-		pch = strtok(NULL, " ");
-		if(pch != NULL){
-			maxProcs = atoi(pch);
-			if(minProcs < 0 || maxProcs < 0){
-				printf("Cannot be below 0\n\n");
-				return false;
-			}
-			if(maxProcs < minProcs){
-				printf("MaxProcs must be greater than MinProcs!\n\n");
-				return false;
-			}
+
+	if(batchFile != NULL){
+		FILE *in = strcmp(batchFile, "-") ? fopen(batchFile, "r") : stdin;
+		if(in == NULL){
+			perror(batchFile);
+			return 1;
 		}
-		pch = strtok(NULL, " ");
-		if(pch != NULL){
-			int i;
-			for(i = 0; serverList[i]; i++){
-				if(!strcmp(pch, serverList[i])){
-					printf("Cannot reuse server names!\n\n");
-					return false;
-				}
-			}
-			myName = serverName = pch;
-			printf("\nServer Name: %s\nminProcs: %d\nmaxProcs: %d\n\n", serverName, minProcs, maxProcs);
-			createServer(serverName, minProcs, maxProcs);
+		int failed = runBatch(in);
+		if(in != stdin){
+			fclose(in);
 		}
-	}
-	//create process
-	else if(!strcmp(cmd, commandList[1])){
-		pch = strtok(NULL, " ");
-		int i;
-		for(i = 0; i < totalServers; i++){
-			if(!strcmp(childName[i], pch)){
-				kill(childPid[i], SIGUSR2);
-				return true;
+		else{
+			flushJournal();
+			if(cgroupRoot[0] != '\0' || stateFile[0] != '\0'){
+				stopServers();
 			}
+			removeStatusTable();
+			return failed ? 1 : 0;
 		}
-		printf("\nCould not add a process for that server\n");
-	}
-	//abort server
-	else if(!strcmp(cmd, commandList[2])){
-		pch = strtok(NULL, " ");
-		char *serverName = pch;
-		abortServer(serverName);
 	}
-	//abort process
-	else if(!strcmp(cmd, commandList[3])){
-		pch = strtok(NULL, " ");
-		int i;
-		for(i = 0; i < totalServers; i++){
-			if(!strcmp(childName[i], pch)){
-				kill(childPid[i], SIGUSR1);
-				return true;
-			}
+
+	//stdin cannot be polled when it is a regular file, so it is then
+	//read between rounds of the event loop instead
+	bool inputPolled = watchFd(STDIN_FILENO, &inputSource);
+	while(!inputClosed){
+		pollEvents(inputPolled ? -1 : 0);
+		if(!inputPolled){
+			readInput();
 		}
 	}
-	//display status
-	else if(!strcmp(cmd, commandList[4])){
-		displayStatus();
+	//servers would stop by themselves once their channels close, but
+	//their cgroups can only be removed after they are gone, and those
+	//kept for a later manager have to be told
+	flushJournal();
+	if(controlPath[0] != '\0'){
+		unlink(controlPath);
 	}
-	else{
-		printf("Invalid command. Type -help for a list of commands\n");
-		return false;
+	if(cgroupRoot[0] != '\0' || stateFile[0] != '\0'){
+		stopServers();
 	}
-	return true;
+	removeStatusTable();
+	return 0;
 }
 
+
 /**********************************************************************
- * Handles an interrupt signal
+ * Reads one command line. A line longer than the buffer is rejected
+ * whole, and the command is left empty.
  *
- * Params:	signum:		The argument of a received signal
+ * Params:	in:			The stream to read from
+ * 			command:	Buffer of MAX_STR_LEN characters
+ * Returns:	false at end of input
  *********************************************************************/
-void sighandler(int signum){
-	//parent to child: abort a process
-	if(signum == SIGUSR1){
-		abortProcess();
-		numActive--;
+bool readCommand(FILE *in, char *command){
+	if(fgets(command, MAX_STR_LEN, in) == NULL){
+		return false;
 	}
-	//parent to child: create a process
-	else if(signum == SIGUSR2){
-		createProcess();
-		numActive++;
-		totalServers++;
+	if(strchr(command, '\n') == NULL && !feof(in)){
+		int c;
+		while((c = getc(in)) != '\n' && c != EOF);
+		printf("Command too long\n");
+		command[0] = '\0';
 	}
-	//terminates entire program
-	else if(signum == SIGINT){
-		int i, status;
-		for(i = 0; i < totalServers; i++){
-			if(!strcmp(childName[i], myName)){
-				kill(childPid[i], SIGINT);
-				wait(&status);
-			}
-		}	
-		printf("I am exiting.\n");
-		pthread_mutex_lock(&lock);
-		numActive--;
-		pthread_mutex_unlock(&lock);
-		exit(0);	
-	}	
+	return true;
 }
 
+
 /**********************************************************************
- * Creates a server	by forking a process
+ * Runs every command from a stream without waiting between them.
+ * Server teardowns are only signalled while the batch is issued and
+ * are reaped by the event loop, so aborts of different servers run
+ * concurrently and later commands never wait on them.
  *
- * Params:	minProcs: 	The minimum number of processes that can be
- * 		  				handled at once
- * 		  	maxProcs: 	The maximum number of processes that can be
- * 		  				handled at once
- * 		  	serverName: The name of the server to create
+ * Params:	in:	The stream of commands
+ * Returns:	The number of commands that failed
  *********************************************************************/
-void createServer(char *serverName, int minProcs, int maxProcs){
-	pid_t pid;
-	if((pid = fork()) < 0){ //error
-		perror("Fork failure\n");
-		exit(1);
-	}
-	else if(pid == 0){ //child
-		myName = serverName;
-		min_processes = minProcs;
-		max_processes = maxProcs;
-		int i;
-		for(i = 0; i < minProcs; i++){
-			createProcess(serverName);
+int runBatch(FILE *in){
+	struct batchEntry *entries = NULL;
+	int numEntries = 0, capacity = 0, failed = 0;
+	int line = 0;
+	char command[MAX_STR_LEN];
+	unsigned long long batchStart = nowNanos();
+
+	batchMode = true;
+	while(readCommand(in, command)){
+		line++;
+		command[strcspn(command, "\r\n")] = '\0';
+		if(command[strspn(command, " \t")] == '\0'){
+			continue;
+		}
+		if(numEntries == capacity){
+			capacity = capacity ? capacity * 2 : 64;
+			struct batchEntry *grown = (struct batchEntry *)realloc(entries, capacity * sizeof(struct batchEntry));
+			if(grown == NULL){
+				perror("realloc");
+				break;
+			}
+			entries = grown;
+			batchEntries = entries;
+		}
+		currentEntry = &entries[numEntries++];
+		memset(currentEntry, 0, sizeof(struct batchEntry));
+		currentEntry->line = line;
+		strcpy(currentEntry->text, command);
+		currentEntry->start = nowNanos();
+		currentEntry->ok = parseCommand(command);
+		if(currentEntry->pending){
+			numPending++;
+		}
+		else{
+			currentEntry->end = nowNanos();
 		}
-		pause();
-	}
-	else{ //parent
-		childPid[totalServers] = pid;
-		childName[totalServers] = serverName;
-		pthread_mutex_lock(&lock);
-		serverList[totalServers] = serverName;
-		totalServers++;
-		numActive++;
-		pthread_mutex_unlock(&lock);
 	}
-}
+	currentEntry = NULL;
 
+	//the event loop completes aborted servers in whatever order they
+	//exit
+	while(numPending > 0){
+		pollEvents(-1);
+	}
+	batchMode = false;
+	batchEntries = NULL;
+	if(stateDirty){
+		saveState();
+	}
+	flushJournal();
 
-/**********************************************************************
- * Aborts a specified server. Any children will be aborted as well.
- *
- * Params:	serverName: The name of the server to be aborted 
- *********************************************************************/
-void abortServer(char * serverName){
+	printf("\nBatch summary:\n");
+	printf("%-6s %-6s %10s  %s\n", "line", "result", "usec", "command");
 	int i;
-	int status;
-	for(i = 0; i < totalServers; i++){
-		if(!strcmp(childName[i], serverName)){
-			//kill(childPid[i], SIGUSR1);
-			kill(childPid[i], SIGINT);
-			wait(&status);
+	for(i = 0; i < numEntries; i++){
+		if(!entries[i].ok || entries[i].pending){
+			failed++;
 		}
-	}	
-	pthread_mutex_lock(&lock);
-	numActive--;
-	pthread_mutex_unlock(&lock);
+		printf("%-6d %-6s %10llu  %s\n", entries[i].line,
+				entries[i].pending ? "lost" : entries[i].ok ? "ok" : "failed",
+				entries[i].pending ? 0 : (entries[i].end - entries[i].start) / 1000,
+				entries[i].text);
+	}
+	printf("%d commands, %d failed, %llu usec total\n\n", numEntries, failed,
+			(nowNanos() - batchStart) / 1000);
+	free(entries);
+	return failed;
 }
 
 
 /**********************************************************************
- * Creates a process for the current server
+ * Benchmarks the control plane. At 1, 16, 256 and 4096 workers per
+ * server, each command is issued through parseCommand just as if it
+ * had been typed, and timed until its effect shows up: createserver,
+ * createprocess and abortprocess until the server's worker count in
+ * the status table reaches the new value, abortserver until the
+ * server is reaped, and displaystatus until it returns.
+ *
+ * Servers are expensive to build at the larger sizes, so createserver
+ * and abortserver get fewer repetitions there (reps * 16 / workers,
+ * at least 3). Command output goes to /dev/null and each result is a
+ * JSON line on stdout:
+ * 	{"op":..., "workers":..., "n":..., "p50_us":..., "p99_us":...,
+ * 	 "p999_us":..., "ops_per_sec":...}
+ *
+ * Params:	reps:	How many times each command is timed per size
+ * Returns:	The number of sizes that could not be completed
  *********************************************************************/
-void createProcess(){
-	if(numActive == max_processes){
-		printf("Cannot create more processes!\n");
-		return;
-	}
+int runBenchmark(int reps){
+	static const int sizes[] = {1, 16, 256, 4096};
+	static const char *ops[] = {"createserver", "abortserver", "createprocess", "abortprocess", "displaystatus"};
+	int numSizes = sizeof(sizes) / sizeof(sizes[0]);
 
-	pid_t pid;
-	if((pid = fork()) < 0){ //error
-		perror("Fork failure\n");
-		exit(1);
+	//results keep the real stdout; command chatter, including that of
+	//every server, goes to /dev/null
+	fflush(stdout);
+	int resultFd = dup(STDOUT_FILENO);
+	int nullFd = open("/dev/null", O_WRONLY);
+	if(resultFd < 0 || nullFd < 0 || dup2(nullFd, STDOUT_FILENO) < 0){
+		perror("benchmark output");
+		return numSizes;
 	}
-	else if(pid == 0){ //child
-		printf("Process added\n");
-		pause();
+	close(nullFd);
+	FILE *out = fdopen(resultFd, "w");
+	unsigned long long *samples = (unsigned long long *)malloc(5 * reps * sizeof(unsigned long long));
+	if(out == NULL || samples == NULL){
+		perror("benchmark");
+		return numSizes;
 	}
-	else{ //parent
-		childPid[totalServers] = pid;
-		childName[totalServers] = myName;
-		pthread_mutex_lock(&lock);
-		totalServers++;
-		numActive++;
-		pthread_mutex_unlock(&lock);
+
+	int i, r;
+	for(i = 0; i < numSizes; i++){
+		int workers = sizes[i];
+		int serverReps = reps * 16 / workers;
+		if(serverReps < 3){
+			serverReps = 3;
+		}
+		if(serverReps > reps){
+			serverReps = reps;
+		}
+		int counts[5] = {serverReps, serverReps, reps, reps, reps};
+		unsigned long long *times[5];
+		int op;
+		for(op = 0; op < 5; op++){
+			times[op] = samples + op * reps;
+		}
+		char name[MAX_NAME_LEN];
+		bool ok = true;
+		unsigned long long start;
+
+		//whole servers are built up and torn down
+		for(r = 0; r < serverReps && ok; r++){
+			snprintf(name, sizeof(name), "bench%d_%d", workers, r);
+			start = nowNanos();
+			ok = benchCommand("createserver %d %d %s", workers, workers + 1, name)
+					&& waitForWorkers(name, workers);
+			times[0][r] = nowNanos() - start;
+			start = nowNanos();
+			ok = benchCommand("abortserver %s", name) && ok;
+			while(dyingServers != NULL){
+				pollEvents(-1);
+			}
+			times[1][r] = nowNanos() - start;
+		}
+
+		//then one server of this size is grown, shrunk and displayed
+		snprintf(name, sizeof(name), "bench%d", workers);
+		ok = ok && benchCommand("createserver %d %d %s", workers, workers + 1, name)
+				&& waitForWorkers(name, workers);
+		for(r = 0; r < reps && ok; r++){
+			start = nowNanos();
+			ok = benchCommand("createprocess %s", name) && waitForWorkers(name, workers + 1);
+			times[2][r] = nowNanos() - start;
+			start = nowNanos();
+			ok = ok && benchCommand("abortprocess %s", name) && waitForWorkers(name, workers);
+			times[3][r] = nowNanos() - start;
+			start = nowNanos();
+			ok = ok && benchCommand("displaystatus");
+			fflush(stdout);
+			times[4][r] = nowNanos() - start;
+		}
+		if(findServer(name) != NULL){
+			benchCommand("abortserver %s", name);
+		}
+		while(dyingServers != NULL){
+			pollEvents(-1);
+		}
+
+		if(!ok){
+			fprintf(stderr, "benchmark stopped at %d workers\n", workers);
+			free(samples);
+			fclose(out);
+			return numSizes - i;
+		}
+		for(op = 0; op < 5; op++){
+			reportLatency(out, ops[op], workers, times[op], counts[op]);
+		}
+		fflush(out);
 	}
+	free(samples);
+	fclose(out);
+	return 0;
 }
 
 
 /**********************************************************************
- * Aborts a process for the current server
+ * Runs one benchmark command through the command parser
+ *
+ * Params:	format:	printf format of the command line
+ * Returns:	false if the command failed
  *********************************************************************/
-void abortProcess(){
-	int i, status;
-	printf("serverName: %s\n", myName);
-	for(i = 0; i < MAX_CHILDREN; i++){
-		if((!strcmp(myName, childName[i])) && (getpid() != childPid[i])){
-			if(!(numActive > min_processes)){
-				printf("Cannot abort process!\n");
-				return;
-			}
-			kill(childPid[i], SIGINT);
-			wait(&status);
-			break;
-		}
-	}
-	pthread_mutex_lock(&lock);
-	numActive--;
-	pthread_mutex_unlock(&lock);
+bool benchCommand(const char *format, ...){
+	char command[MAX_STR_LEN];
+	va_list args;
+	va_start(args, format);
+	vsnprintf(command, sizeof(command), format, args);
+	va_end(args);
+	return parseCommand(command);
 }
 
 
 /**********************************************************************
- * Displays the current state of the Process Management System
+ * Waits until a server's worker count in the status table reaches a
+ * value. The manager keeps running its event loop meanwhile, so a
+ * server that dies is noticed instead of waited on forever.
+ *
+ * Params:	name:	The server to watch
+ * 			count:	The worker count to wait for
+ * Returns:	false if the server went away or took over a minute
+ *********************************************************************/
+bool waitForWorkers(const char *name, int count){
+	unsigned long long deadline = nowNanos() + 60000000000ULL;
+	struct server *s;
+	while((s = findServer(name)) != NULL && nowNanos() < deadline){
+		struct serverSlot slot;
+		if(seqRead(&slot, &status->servers[s->slot], sizeof(slot))
+				&& slot.pid == s->pid && slot.numWorkers == count){
+			return true;
+		}
+		pollEvents(0);
+		sched_yield();
+	}
+	return false;
+}
+
+
+/**********************************************************************
+ * Orders two nanosecond samples for qsort
+ *********************************************************************/
+int compareNanos(const void *a, const void *b){
+	unsigned long long x = *(const unsigned long long *)a;
+	unsigned long long y = *(const unsigned long long *)b;
+	return x < y ? -1 : x > y;
+}
+
+
+/**********************************************************************
+ * Writes one benchmark result as a JSON line. Percentiles use the
+ * nearest-rank method, so p999 is the maximum below 1000 samples.
+ *
+ * Params:	out:		Where the line is written
+ * 			op:			The command that was timed
+ * 			workers:	The server size it was timed at
+ * 			samples:	The latencies in nanoseconds, sorted in place
+ * 			n:			The number of samples
+ *********************************************************************/
+void reportLatency(FILE *out, const char *op, int workers, unsigned long long *samples, int n){
+	static const int permille[3] = {500, 990, 999};
+	unsigned long long total = 0, pct[3];
+	int i;
+	qsort(samples, n, sizeof(unsigned long long), compareNanos);
+	for(i = 0; i < n; i++){
+		total += samples[i];
+	}
+	for(i = 0; i < 3; i++){
+		int rank = (int)(((long long)n * permille[i] + 999) / 1000);
+		pct[i] = samples[rank > 0 ? rank - 1 : 0];
+	}
+	fprintf(out, "{\"op\":\"%s\",\"workers\":%d,\"n\":%d,\"p50_us\":%.1f,\"p99_us\":%.1f,"
+			"\"p999_us\":%.1f,\"ops_per_sec\":%.1f}\n", op, workers, n,
+			pct[0] / 1e3, pct[1] / 1e3, pct[2] / 1e3, total ? n / (total / 1e9) : 0.0);
+}
+
+
+/**********************************************************************
+ * Returns a monotonic timestamp in nanoseconds
+ *********************************************************************/
+unsigned long long nowNanos(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+/**********************************************************************
+ * Parses a non-negative count argument
+ *
+ * Params:	str:	The argument to parse
+ * 			value:	Where the parsed count is stored
+ * Returns:	true if str was a whole non-negative number
+ *********************************************************************/
+bool parseCount(const char *str, int *value){
+	char *end;
+	errno = 0;
+	long n = strtol(str, &end, 10);
+	if(errno || end == str || *end != '\0' || n < 0 || n > MAX_COUNT){
+		return false;
+	}
+	*value = (int)n;
+	return true;
+}
+
+
+/**********************************************************************
+ * Parses a non-negative decimal argument such as a load threshold
+ *
+ * Params:	str:	The argument to parse
+ * 			value:	Where the parsed number is stored
+ * Returns:	true if str was a whole non-negative number
+ *********************************************************************/
+bool parseFraction(const char *str, double *value){
+	char *end;
+	errno = 0;
+	double n = strtod(str, &end);
+	if(errno || end == str || *end != '\0' || !(n >= 0)){
+		return false;
+	}
+	*value = n;
+	return true;
+}
+
+
+/**********************************************************************
+ * Parses the OPTION=VALUE settings that follow a createserver
+ *
+ * Params:	cfg:		The configuration to fill in
+ * 			opts:		The option arguments
+ * 			numOpts:	How many option arguments there are
+ * Returns:	false if any option is unknown or has a bad value
+ *********************************************************************/
+bool parseServerOptions(struct serverConfig *cfg, char **opts, int numOpts){
+	int i;
+	for(i = 0; i < numOpts; i++){
+		char *value = strchr(opts[i], '=');
+		if(value == NULL){
+			printf("Options must look like OPTION=VALUE: %s\n", opts[i]);
+			return false;
+		}
+		*value++ = '\0';
+		if(!strcmp(opts[i], "spares")){
+			if(!parseCount(value, &cfg->spares)){
+				printf("Bad spare count: %s\n", value);
+				return false;
+			}
+		}
+		else if(!strcmp(opts[i], "backend")){
+			if((cfg->backend = findBackend(value)) == NULL){
+				printf("Unknown backend: %s\n", value);
+				return false;
+			}
+		}
+		else if(!strcmp(opts[i], "autoscale")){
+			if(!strcmp(value, "cpu")){
+				cfg->autoscale = SCALE_CPU;
+			}
+			else if(!strcmp(value, "queue")){
+				cfg->autoscale = SCALE_QUEUE;
+			}
+			else if(!strncmp(value, "file:", 5) && value[5] != '\0'){
+				cfg->autoscale = SCALE_FILE;
+				strncpy(cfg->loadFile, value + 5, sizeof(cfg->loadFile) - 1);
+			}
+			else{
+				printf("Unknown load signal: %s\n", value);
+				return false;
+			}
+		}
+		else if(!strcmp(opts[i], "scaleup") || !strcmp(opts[i], "scaledown")){
+			if(!parseFraction(value, opts[i][5] == 'u' ? &cfg->scaleUp : &cfg->scaleDown)){
+				printf("Bad load threshold: %s\n", value);
+				return false;
+			}
+		}
+		else if(!strcmp(opts[i], "cpumax") || !strcmp(opts[i], "memmax") || !strcmp(opts[i], "pidsmax")){
+			//cpu.max takes "QUOTA PERIOD", written QUOTA/PERIOD here
+			//so it stays one word; memory.max also takes K, M and G
+			char *field = opts[i][0] == 'c' ? cfg->cpuMax : opts[i][0] == 'm' ? cfg->memMax : cfg->pidsMax;
+			char *period = field == cfg->cpuMax ? strchr(value, '/') : NULL;
+			if(period != NULL){
+				*period++ = '\0';
+			}
+			if(!validLimit(value, field == cfg->memMax ? "KMG" : "")
+					|| (period != NULL && (!validLimit(period, "") || !strcmp(period, "max")))){
+				printf("Bad %s: %s\n", opts[i], value);
+				return false;
+			}
+			if(cgroupRoot[0] == '\0'){
+				printf("%s needs a cgroup directory (-c)\n", opts[i]);
+				return false;
+			}
+			snprintf(field, sizeof(cfg->cpuMax), "%s%s%s", value, period ? " " : "", period ? period : "");
+		}
+		else if(!strcmp(opts[i], "placement")){
+			if(!strcmp(value, "spread")){
+				cfg->placement = PLACE_SPREAD;
+			}
+			else if(!strcmp(value, "pack")){
+				cfg->placement = PLACE_PACK;
+			}
+			else if(!strncmp(value, "pin:", 4) && parseCpuList(value + 4, &cfg->pinSet)){
+				cfg->placement = PLACE_PIN;
+			}
+			else{
+				printf("Bad placement: %s\n", value);
+				return false;
+			}
+		}
+		else if(!strcmp(opts[i], "spawnrate")){
+			if(!parseRate(value, &cfg->spawnRate, &cfg->spawnBurst)){
+				printf("Bad spawnrate: %s\n", value);
+				return false;
+			}
+		}
+		else if(!strcmp(opts[i], "heartbeat")){
+			//a healthy but idle worker beats every HEARTBEAT_MS, so
+			//anything shorter would catch it between beats
+			if(!parseCount(value, &cfg->heartbeat) || (cfg->heartbeat != 0 && cfg->heartbeat < 2 * HEARTBEAT_MS)){
+				printf("Bad heartbeat: %s (0 or at least %d ms)\n", value, 2 * HEARTBEAT_MS);
+				return false;
+			}
+		}
+		else if(!strcmp(opts[i], "interval") || !strcmp(opts[i], "cooldown") || !strcmp(opts[i], "drain")){
+			int *field = opts[i][0] == 'i' ? &cfg->interval : opts[i][0] == 'c' ? &cfg->cooldown : &cfg->drain;
+			if(!parseCount(value, field) || (field != &cfg->cooldown && *field == 0)){
+				printf("Bad %s: %s\n", opts[i], value);
+				return false;
+			}
+		}
+		else{
+			printf("Unknown server option: %s\n", opts[i]);
+			return false;
+		}
+	}
+	return true;
+}
+
+
+/**********************************************************************
+ * Parses the command received from the user. The line is split in
+ * place, so no memory is allocated, and strtok_r keeps the parser
+ * reentrant. Each known command is timed into its histogram, and each
+ * accepted one is journaled with -j. The words are joined for the
+ * journal before the command runs, since option parsing splits them.
+ *
+ * Params:	cmd:	The string of characters inputted by the user
+ *********************************************************************/
+bool parseCommand(char * cmd){
+	char *argv[MAX_ARGS];
+	char *save;
+	int argc = 0;
+	char *pch = strtok_r(cmd, " \t\r\n", &save);
+	while(pch != NULL && argc < MAX_ARGS){
+		argv[argc++] = pch;
+		pch = strtok_r(NULL, " \t\r\n", &save);
+	}
+	if(argc == 0){
+		return false;
+	}
+	if(pch != NULL){
+		printf("Too many arguments\n");
+		return false;
+	}
+
+	char text[MAX_STR_LEN];
+	bool journaled = journalFd >= 0 && !journalMuted;
+	if(journaled){
+		int i, len = 0;
+		for(i = 0; i < argc; i++){
+			len += snprintf(text + len, sizeof(text) - len, i ? " %s" : "%s", argv[i]);
+		}
+	}
+
+	int id;
+	for(id = 0; id < NUM_COMMANDS && strcmp(argv[0], commandList[id]); id++);
+	unsigned long long start = nowNanos();
+	bool ok = runCommand(argc, argv);
+	if(id < NUM_COMMANDS){
+		recordStat(id, nowNanos() - start);
+	}
+	if(ok && journaled){
+		journalCommand(text);
+	}
+	return ok;
+}
+
+
+/**********************************************************************
+ * Runs one command that has been split into words
+ *
+ * Params:	argc:	The number of words
+ * 			argv:	The words, starting with the command name
+ * Returns:	false if the command failed
+ *********************************************************************/
+bool runCommand(int argc, char **argv){
+	//help	
+	if(!strcmp(argv[0], "-help")){
+		static const char *commandArgs[NUM_COMMANDS] = {"<MIN_PROCESSES> <MAX_PROCESSES> <SERVERNAME> [OPTION=VALUE...]",
+			"<SERVERNAME> [COUNT]", "<SERVERNAME>", "<SERVERNAME> [COUNT]", "<NONE>", "<COUNT> [HEAP_MB]", "[reset]",
+			"<SERVERNAME> <COUNT> <COST_US>", "<SERVERNAME>", "<NONE>", "<INTERVAL_MS|off> [FILE]"};
+		printf("Commands list:\n");
+		int i;
+		for(i = 0; i < NUM_COMMANDS; i++){
+			printf("%s\t%s\n", commandList[i], commandArgs[i]);
+		}
+	}
+	//createserver
+	else if(!strcmp(argv[0], commandList[0])){
+		struct serverConfig cfg;
+		memset(&cfg, 0, sizeof(cfg));
+		cfg.backend = &backends[0];
+		cfg.scaleUp = 0.75;
+		cfg.scaleDown = 0.25;
+		cfg.interval = 1000;
+		cfg.cooldown = 5;
+		cfg.heartbeat = 5000;
+		cfg.drain = 10000;
+		if(argc < 4){
+			printf("Usage: %s <MIN_PROCESSES> <MAX_PROCESSES> <SERVERNAME> [OPTION=VALUE...]\n\n", commandList[0]);
+			return false;
+		}
+		if(!parseCount(argv[1], &cfg.minProcs) || !parseCount(argv[2], &cfg.maxProcs)){
+			printf("Cannot be below 0\n\n");
+			return false;
+		}
+		if(cfg.maxProcs < cfg.minProcs){
+			printf("MaxProcs must be greater than MinProcs!\n\n");
+			return false;
+		}
+		if(findServer(argv[3])){
+			printf("Cannot reuse server names!\n\n");
+			return false;
+		}
+		if(strlen(argv[3]) >= MAX_NAME_LEN){
+			printf("Server name too long!\n\n");
+			return false;
+		}
+		if(cgroupRoot[0] != '\0' && (strchr(argv[3], '/') || argv[3][0] == '.')){
+			printf("Server name cannot name a cgroup!\n\n");
+			return false;
+		}
+		if(!parseServerOptions(&cfg, argv + 4, argc - 4)){
+			return false;
+		}
+		if(cfg.scaleDown >= cfg.scaleUp){
+			printf("scaledown must be below scaleup\n\n");
+			return false;
+		}
+		printf("\nServer Name: %s\nminProcs: %d\nmaxProcs: %d\nbackend: %s\n\n", argv[3], cfg.minProcs, cfg.maxProcs, cfg.backend->name);
+		if(!createServer(argv[3], &cfg)){
+			return false;
+		}
+	}
+	//create process
+	else if(!strcmp(argv[0], commandList[1])){
+		int count = 1;
+		if(argc < 2 || argc > 3 || (argc == 3 && !parseCount(argv[2], &count))){
+			printf("Usage: %s <SERVERNAME> [COUNT]\n", commandList[1]);
+			return false;
+		}
+		struct server *s = findServer(argv[1]);
+		if(s && sendMessage(s, MSG_SPAWN, count, 0)){
+			return true;
+		}
+		printf("\nCould not add a process for that server\n");
+	}
+	//abort server
+	else if(!strcmp(argv[0], commandList[2])){
+		if(argc != 2){
+			printf("Usage: %s <SERVERNAME>\n", commandList[2]);
+			return false;
+		}
+		return abortServer(argv[1]);
+	}
+	//abort process
+	else if(!strcmp(argv[0], commandList[3])){
+		int count = 1;
+		if(argc < 2 || argc > 3 || (argc == 3 && !parseCount(argv[2], &count))){
+			printf("Usage: %s <SERVERNAME> [COUNT]\n", commandList[3]);
+			return false;
+		}
+		struct server *s = findServer(argv[1]);
+		if(s && sendMessage(s, MSG_RETIRE, count, 0)){
+			return true;
+		}
+		printf("\nCould not abort a process for that server\n");
+	}
+	//display status
+	else if(!strcmp(argv[0], commandList[4])){
+		displayStatus();
+	}
+	//compare spawn backends
+	else if(!strcmp(argv[0], commandList[5])){
+		int count, heapMegs = 0;
+		if(argc < 2 || argc > 3 || !parseCount(argv[1], &count) || count == 0
+				|| (argc == 3 && !parseCount(argv[2], &heapMegs))){
+			printf("Usage: %s <COUNT> [HEAP_MB]\n", commandList[5]);
+			return false;
+		}
+		compareSpawn(count, heapMegs);
+	}
+	//latency histograms
+	else if(!strcmp(argv[0], commandList[6])){
+		if(argc > 2 || (argc == 2 && strcmp(argv[1], "reset"))){
+			printf("Usage: %s [reset]\n", commandList[6]);
+			return false;
+		}
+		int type = argc == 2 ? MSG_RESET_STATS : MSG_STATS;
+		if(type == MSG_STATS){
+			printf("manager:\n");
+			printStats();
+			fflush(stdout);
+		}
+		else{
+			resetStats();
+		}
+		int i;
+		for(i = 0; i < servers.size; i++){
+			struct server *s = servers.slots[i];
+			if(s && s != &tombstone){
+				sendMessage(s, type, 0, 0);
+			}
+		}
+	}
+	//submit tasks
+	else if(!strcmp(argv[0], commandList[7])){
+		int count, cost;
+		if(argc != 4 || !parseCount(argv[2], &count) || !parseCount(argv[3], &cost)){
+			printf("Usage: %s <SERVERNAME> <COUNT> <COST_US>\n", commandList[7]);
+			return false;
+		}
+		struct server *s = findServer(argv[1]);
+		if(s && sendMessage(s, MSG_SUBMIT, count, cost)){
+			return true;
+		}
+		printf("\nCould not submit tasks to that server\n");
+		return false;
+	}
+	//rebalance workers over the placement targets
+	else if(!strcmp(argv[0], commandList[8])){
+		if(argc != 2){
+			printf("Usage: %s <SERVERNAME>\n", commandList[8]);
+			return false;
+		}
+		struct server *s = findServer(argv[1]);
+		if(s && s->config.placement != PLACE_NONE && sendMessage(s, MSG_REBALANCE, 0, 0)){
+			return true;
+		}
+		printf("\nThat server has no placement to rebalance\n");
+		return false;
+	}
+	//detach: exit, leaving the servers for the next manager to adopt
+	else if(!strcmp(argv[0], commandList[9])){
+		if(stateFile[0] == '\0'){
+			printf("%s needs a state file (-s)\n", commandList[9]);
+			return false;
+		}
+		flushJournal();
+		saveState();
+		//connected clients keep their connections; only new ones are
+		//turned away
+		if(controlPath[0] != '\0'){
+			unlink(controlPath);
+		}
+		printf("Detached from %d servers\n", servers.count);
+		//a control socket client is sent its reply before the exit
+		if(commandClient != NULL){
+			detached = true;
+			return true;
+		}
+		fflush(stdout);
+		exit(0);
+	}
+	//watch: stream status changes as JSON lines
+	else if(!strcmp(argv[0], commandList[10])){
+		int interval;
+		if(argc == 2 && !strcmp(argv[1], "off")){
+			stopWatch();
+			return true;
+		}
+		if(argc < 2 || argc > 3 || !parseCount(argv[1], &interval) || interval == 0){
+			printf("Usage: %s <INTERVAL_MS|off> [FILE]\n", commandList[10]);
+			return false;
+		}
+		return startWatch(interval, argc == 3 ? argv[2] : NULL);
+	}
+	else{
+		printf("Invalid command. Type -help for a list of commands\n");
+		return false;
+	}
+	return true;
+}
+
+/**********************************************************************
+ * Handles an interrupt or termination signal. Only workers take
+ * signals this way; the manager and servers read theirs from a
+ * signalfd.
+ *
+ * Params:	signum:		The argument of a received signal
+ *********************************************************************/
+void sighandler(int signum){
+	//a worker holding a task finishes it before it stops
+	if((signum == SIGINT || signum == SIGTERM) && taskBusy){
+		stopRequested = 1;
+		return;
+	}
+	//terminates the worker; the signal can land in the middle of a
+	//printf, so only async-signal-safe calls are made here
+	if(signum == SIGINT || signum == SIGTERM){
+		static const char msg[] = "I am exiting.\n";
+		if(write(STDOUT_FILENO, msg, sizeof(msg) - 1) < 0){
+			_exit(1);
+		}
+		_exit(0);
+	}	
+}
+
+/**********************************************************************
+ * Creates a server	by forking a process
+ *
+ * Params:	serverName: The name of the server to create
+ * 			cfg:		The minimum and maximum number of processes
+ * 						that can be handled at once, plus any
+ * 						server options
+ * Returns:	false if the server could not be started
+ *********************************************************************/
+bool createServer(char *serverName, struct serverConfig *cfg){
+	cfg->persistent = stateFile[0] != '\0';
+	struct server *s = addServer(serverName, -1);
+	if(s == NULL){
+		printf("Cannot create more servers!\n");
+		return false;
+	}
+	s->config = *cfg;
+	s->batchEntry = -1;
+	s->exitSource.type = SRC_SERVER;
+	s->exitSource.owner = s;
+	if(cgroupRoot[0] != '\0' && !createCgroup(s)){
+		removeServer(s);
+		releaseServerSlot(s);
+		freeServer(s);
+		return false;
+	}
+
+	int fds[2];
+	if(socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) < 0){
+		perror("socketpair");
+		removeCgroup(s);
+		removeServer(s);
+		releaseServerSlot(s);
+		freeServer(s);
+		return false;
+	}
+
+	//the slot is filled before the fork so the server's first update
+	//can never be overwritten; the server adds its pid itself
+	struct serverSlot *slot = &status->servers[s->slot];
+	seqBegin(&slot->seq);
+	slot->inUse = 1;
+	slot->pid = 0;
+	slot->minProcs = cfg->minProcs;
+	slot->maxProcs = cfg->maxProcs;
+	slot->numWorkers = slot->numSpares = slot->poolHits = slot->poolMisses = 0;
+	slot->spares = cfg->spares;
+	slot->load = 0;
+	memset(&slot->usage, 0, sizeof(slot->usage));
+	slot->queued = slot->running = 0;
+	slot->submitted = slot->done = slot->stolen = 0;
+	strncpy(slot->backend, cfg->backend->name, sizeof(slot->backend) - 1);
+	static const char *placements[] = {"", "pin", "spread", "pack"};
+	strcpy(slot->placement, placements[cfg->placement]);
+	slot->targets = 0;
+	slot->numExits = 0;
+	slot->firstOwned = 0;
+	strcpy(slot->name, s->name);
+	seqEnd(&slot->seq);
+
+	//SIGINT stays blocked until each side has recorded who it is
+	sigset_t intMask, oldMask;
+	sigemptyset(&intMask);
+	sigaddset(&intMask, SIGINT);
+	sigaddset(&intMask, SIGTERM);
+	sigprocmask(SIG_BLOCK, &intMask, &oldMask);
+
+	pid_t pid;
+	fflush(stdout);
+	unsigned long long start = nowNanos();
+	if((pid = fork()) < 0){ //error
+		perror("Fork failure\n");
+		exit(1);
+	}
+	else if(pid == 0){ //child
+		int i;
+		resetStats();
+		//drop the manager's descriptors, including its ends of every
+		//other server's channel so those servers still see EOF if the
+		//manager goes away
+		closeInheritedFds(fds[1]);
+		//the server leads a process group its workers join, so the
+		//whole server can be signalled at once; both sides set it so
+		//neither can signal the group before it exists
+		setpgid(0, 0);
+		//a server kept for a later manager must not die writing to
+		//the old manager's output
+		if(s->config.persistent){
+			signal(SIGPIPE, SIG_IGN);
+		}
+		//workers inherit the cgroup, so it is joined before any start
+		if(s->cgroup){
+			char dir[CGROUP_DIR_LEN];
+			cgroupDir(s, dir, sizeof(dir));
+			if(!writeCgroup(dir, "cgroup.procs", "0")){
+				printf("Cannot join cgroup %s: %s\n", dir, strerror(errno));
+				exit(1);
+			}
+		}
+		role = SERVER;
+		self = s;
+		self->pid = getpid();
+		self->cmdFd = fds[1];
+		numActive = 0;
+		numUnwatched = 0;
+		if(!setupEvents() || !watchFd(self->cmdFd, &channelSource)){
+			exit(1);
+		}
+		if(!startTimer(self->config.interval) || !createTaskPool()){
+			exit(1);
+		}
+		setupPlacement();
+		setBucket(&self->spawnBucket, self->config.spawnRate, self->config.spawnBurst);
+		if(self->config.persistent && !listenForManager()){
+			exit(1);
+		}
+		sigprocmask(SIG_SETMASK, &oldMask, NULL);
+		//whatever the rate limits hold back, or fails to start, is
+		//started by serverLoop
+		self->queuedStarts = self->config.minProcs;
+		for(i = 0; i < self->config.minProcs && takeSpawnToken(); i++){
+			struct worker *w = startWorker(false);
+			if(w == NULL){
+				startFailed();
+				break;
+			}
+			activateWorker(w);
+			self->queuedStarts--;
+		}
+		serverLoop();
+		exit(0);
+	}
+	else{ //parent
+		recordStat(STAT_FORK_SERVER, nowNanos() - start);
+		setpgid(pid, pid);
+		close(fds[1]);
+		s->cmdFd = fds[0];
+		s->pid = pid;
+		readStartTime(pid, &s->startTime);
+		watchChild(pid, &s->pidFd, &s->exitSource);
+		stateDirty = true;
+		sigprocmask(SIG_SETMASK, &oldMask, NULL);
+		pthread_mutex_lock(&lock);
+		numActive++;
+		pthread_mutex_unlock(&lock);
+	}
+	return true;
+}
+
+
+/**********************************************************************
+ * Aborts a specified server. Any children will be aborted as well.
+ * The server's whole process group is signalled here, so its workers
+ * stop alongside it; the event loop reaps it, so a slow teardown never
+ * stalls the next command, and kills the group if it outlives -k.
+ *
+ * Params:	serverName: The name of the server to be aborted 
+ * Returns:	false if there is no such server
+ *********************************************************************/
+bool abortServer(char * serverName){
+	struct server *s = findServer(serverName);
+	if(s == NULL){
+		printf("No server named %s\n", serverName);
+		return false;
+	}
+	s->killedAt = nowNanos();
+	//a stopped worker would hold its SIGTERM pending until continued
+	killpg(s->pid, SIGTERM);
+	killpg(s->pid, SIGCONT);
+	recordStat(STAT_KILL_SERVER, nowNanos() - s->killedAt);
+	if(batchMode && currentEntry != NULL){
+		//completed when the event loop reaps the server
+		currentEntry->pending = true;
+		s->batchEntry = currentEntry - batchEntries;
+	}
+	close(s->cmdFd);
+	s->cmdFd = -1;
+	removeServer(s);
+	s->dying = true;
+	s->prev = NULL;
+	s->next = dyingServers;
+	if(dyingServers != NULL){
+		dyingServers->prev = s;
+	}
+	dyingServers = s;
+	armDeadline();
+	stateDirty = true;
+	pthread_mutex_lock(&lock);
+	numActive--;
+	pthread_mutex_unlock(&lock);
+	return true;
+}
+
+
+/**********************************************************************
+ * Creates a process for the current server. A warm spare is promoted
+ * when one is available; otherwise a new worker is forked. A start
+ * the rate limits hold back, or that fails, is queued for serverLoop.
+ *********************************************************************/
+void createProcess(){
+	if(self->numWorkers + self->queuedStarts >= self->config.maxProcs){
+		printf("Cannot create more processes!\n");
+		return;
+	}
+
+	struct worker *w = self->spares;
+	if(w != NULL){
+		unsigned long long start = nowNanos();
+		self->config.backend->promote(w);
+		recordStat(STAT_PROMOTE_WORKER, nowNanos() - start);
+		listRemove(&self->spares, w);
+		self->numSpares--;
+		self->poolHits++;
+		//a parked spare does not beat, so its clock starts now
+		w->beatAt = nowNanos();
+	}
+	else{
+		self->poolMisses++;
+		//starts keep their order, so one queued already goes first,
+		//and none is tried while failed ones are backing off
+		if(self->queuedStarts > 0 || self->retryAt > nowNanos() || !takeSpawnToken()){
+			self->queuedStarts++;
+			return;
+		}
+		w = startWorker(false);
+		if(w == NULL){
+			startFailed();
+			self->queuedStarts++;
+			return;
+		}
+	}
+	activateWorker(w);
+}
+
+
+/**********************************************************************
+ * Puts a newly started or promoted worker on the active list
+ *
+ * Params:	w:	The worker
+ *********************************************************************/
+void activateWorker(struct worker *w){
+	pthread_mutex_lock(&lock);
+	w->state = ACTIVE;
+	listPush(&self->workers, w);
+	self->numWorkers++;
+	numActive++;
+	pthread_mutex_unlock(&lock);
+	publishWorker(w);
+}
+
+
+/**********************************************************************
+ * Starts a worker for the current server with its configured backend
+ *
+ * Params:	spare:	true to park the worker in the spare pool until
+ * 					it is promoted with SIGUSR1
+ * Returns:	The new worker record, not yet on any list
+ *********************************************************************/
+struct worker *startWorker(bool spare){
+	int index;
+	struct worker *w = (struct worker *)slabAlloc(&workerSlab, &index);
+	if(w == NULL){
+		return NULL;
+	}
+	w->index = index;
+	w->pidFd = -1;
+	w->exitSource.type = SRC_WORKER;
+	w->exitSource.owner = w;
+	w->deque = claimDeque();
+	if((w->target = pickTarget()) >= 0){
+		self->targetLoad[w->target]++;
+	}
+	//claimed first so the worker knows where to beat
+	w->slot = claimWorkerSlot();
+	unsigned long long start = nowNanos();
+	if(!self->config.backend->start(w, spare)){
+		releaseWorkerSlot(w);
+		self->dequeUsers[w->deque]--;
+		if(w->target >= 0){
+			self->targetLoad[w->target]--;
+		}
+		slabFree(&workerSlab, index);
+		return NULL;
+	}
+	w->beatAt = nowNanos();
+	recordStat(STAT_START_WORKER, w->beatAt - start);
+	w->state = spare ? SPARE : ACTIVE;
+	//a start that works ends any backoff after failed ones
+	self->startFailures = 0;
+	self->retryAt = 0;
+	//a thread worker brings its own exit descriptor
+	if(w->pidFd < 0){
+		watchChild(w->pid, &w->pidFd, &w->exitSource);
+	}
+	publishWorker(w);
+	return w;
+}
+
+
+/**********************************************************************
+ * Fork backend: the worker is a copy of the calling process
+ *
+ * Params:	w:		The worker record to fill in
+ * 			spare:	true to start the worker as a spare
+ * Returns:	false if the fork failed
+ *********************************************************************/
+bool forkStart(struct worker *w, bool spare){
+	//SIGUSR1 is blocked too so a promotion sent early stays pending
+	sigset_t intMask, oldMask;
+	sigemptyset(&intMask);
+	sigaddset(&intMask, SIGINT);
+	sigaddset(&intMask, SIGTERM);
+	sigaddset(&intMask, SIGUSR1);
+	sigprocmask(SIG_BLOCK, &intMask, &oldMask);
+
+	pid_t pid;
+	fflush(stdout);
+	if((pid = fork()) < 0){ //error
+		//the server and its other workers carry on; the caller queues
+		//the start for a retry
+		perror("fork");
+		sigprocmask(SIG_SETMASK, &oldMask, NULL);
+		return false;
+	}
+	else if(pid == 0){ //child
+		//a worker needs none of the parent's channels or pidfds
+		closeInheritedFds(-1);
+		//bound before the worker touches any memory, so its pages
+		//are allocated on its own node
+		applyPlacement(0, w->target);
+		if(w->slot >= 0){
+			beatSlot = &status->workers[w->slot];
+		}
+		workerMain(spare, w->deque);
+	}
+	w->pid = pid;
+	sigprocmask(SIG_SETMASK, &oldMask, NULL);
+	return true;
+}
+
+
+/**********************************************************************
+ * Spawn backend: the worker execs a fresh copy of this program with
+ * -w, so nothing of the caller's address space is duplicated. The
+ * signal mask is set by posix_spawn, which keeps an early promotion
+ * pending exactly as the fork backend does.
+ *
+ * Params:	w:		The worker record to fill in
+ * 			spare:	true to start the worker as a spare
+ * Returns:	false if the spawn failed
+ *********************************************************************/
+bool spawnStart(struct worker *w, bool spare){
+	posix_spawnattr_t attr;
+	sigset_t mask;
+	char role[128];
+	char *args[] = {"processManager", "-w", role, NULL};
+	snprintf(role, sizeof(role), "%s:%d:%d:%d:%s", spare ? "spare" : "worker", w->deque, taskFd, w->slot, statusName);
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGUSR1);
+	posix_spawnattr_init(&attr);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+	posix_spawnattr_setsigmask(&attr, &mask);
+
+	//channels, pidfds and the event loop's descriptors are all
+	//close-on-exec, so the worker inherits none of them; only the
+	//task pool's memfd is passed on
+	fflush(stdout);
+	int err = posix_spawn(&w->pid, workerImage, NULL, &attr, args, environ);
+	posix_spawnattr_destroy(&attr);
+	if(err != 0){
+		errno = err;
+		perror("posix_spawn");
+		return false;
+	}
+	//posix_spawn has no affinity attribute, so the new image is bound
+	//from outside as soon as it exists
+	applyPlacement(w->pid, w->target);
+	return true;
+}
+
+
+/**********************************************************************
+ * Promotes a spare process with SIGUSR1
+ *
+ * Params:	w:	The spare to promote
+ *********************************************************************/
+void signalPromote(struct worker *w){
+	kill(w->pid, SIGUSR1);
+}
+
+
+/**********************************************************************
+ * Stops a worker process with SIGINT
+ *
+ * Params:	w:	The worker to stop
+ *********************************************************************/
+void signalStop(struct worker *w){
+	kill(w->pid, SIGINT);
+}
+
+
+/**********************************************************************
+ * Reaps a worker process
+ *
+ * Params:	w:		The worker to reap
+ * 			ru:		Where its final resource usage is stored
+ * 			block:	true to wait for it to exit
+ * Returns:	false if it has not exited
+ *********************************************************************/
+bool waitReap(struct worker *w, struct rusage *ru, bool block){
+	int status = 0;
+	pid_t pid;
+	do{
+		pid = wait4(w->pid, &status, block ? 0 : WNOHANG, ru);
+	}while(pid < 0 && errno == EINTR);
+	w->exitStatus = status;
+	return pid > 0;
+}
+
+
+/**********************************************************************
+ * Thread backend: the worker is a thread of the calling process with
+ * a small stack. It inherits the caller's signal mask, so the
+ * server's signals still go to its signalfd. The call returns once
+ * the thread has recorded its id.
+ *
+ * Params:	w:		The worker record to fill in
+ * 			spare:	true to start the worker as a spare
+ * Returns:	false if the thread could not be started
+ *********************************************************************/
+bool threadStart(struct worker *w, bool spare){
+	w->pidFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if(w->pidFd < 0){
+		perror("eventfd");
+		return false;
+	}
+	if(!watchFd(w->pidFd, &w->exitSource)){
+		close(w->pidFd);
+		w->pidFd = -1;
+		return false;
+	}
+	w->promoted = !spare;
+	w->stopping = false;
+	w->pid = 0;
+
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, THREAD_STACK);
+	int err = pthread_create(&w->thread, &attr, workerThread, w);
+	pthread_attr_destroy(&attr);
+	if(err != 0){
+		errno = err;
+		perror("pthread_create");
+		close(w->pidFd);
+		w->pidFd = -1;
+		return false;
+	}
+	pthread_mutex_lock(&threadLock);
+	while(w->pid == 0){
+		pthread_cond_wait(&threadWake, &threadLock);
+	}
+	pthread_mutex_unlock(&threadLock);
+	return true;
+}
+
+
+/**********************************************************************
+ * Body of a thread worker. It does what workerMain does in a worker
+ * process, waiting on threadWake instead of for signals, and leaves
+ * its rusage behind before it signals its exit descriptor.
+ *
+ * Params:	arg:	The worker record
+ *********************************************************************/
+void *workerThread(void *arg){
+	struct worker *w = (struct worker *)arg;
+	applyPlacement(0, w->target);
+	pthread_mutex_lock(&threadLock);
+	w->pid = syscall(SYS_gettid);
+	pthread_cond_broadcast(&threadWake);
+	while(!w->promoted && !w->stopping){
+		pthread_cond_wait(&threadWake, &threadLock);
+	}
+	if(!w->stopping){
+		pthread_mutex_unlock(&threadLock);
+		printf("Process added\n");
+		fflush(stdout);
+		if(taskPool != NULL){
+			runTasks(w->deque, w);
+		}
+		else{
+			pthread_mutex_lock(&threadLock);
+			while(!w->stopping){
+				pthread_cond_wait(&threadWake, &threadLock);
+			}
+			pthread_mutex_unlock(&threadLock);
+		}
+		printf("I am exiting.\n");
+		fflush(stdout);
+	}
+	else{
+		pthread_mutex_unlock(&threadLock);
+		if(taskPool != NULL){
+			//take back the wakeup threadStop posted
+			while(sem_wait(&taskPool->pending) != 0);
+			__atomic_sub_fetch(&taskPool->stopsPending, 1, __ATOMIC_RELAXED);
+		}
+	}
+
+	getrusage(RUSAGE_THREAD, &w->exitUsage);
+	unsigned long long one = 1;
+	if(write(w->pidFd, &one, sizeof(one)) != sizeof(one)){
+		perror("eventfd");
+	}
+	return NULL;
+}
+
+
+/**********************************************************************
+ * Promotes a spare thread
+ *
+ * Params:	w:	The spare to promote
+ *********************************************************************/
+void threadPromote(struct worker *w){
+	pthread_mutex_lock(&threadLock);
+	w->promoted = true;
+	pthread_cond_broadcast(&threadWake);
+	pthread_mutex_unlock(&threadLock);
+}
+
+
+/**********************************************************************
+ * Asks a thread worker to exit. One that may be asleep in sem_wait
+ * is woken with an extra post on the task pool.
+ *
+ * Params:	w:	The worker to stop
+ *********************************************************************/
+void threadStop(struct worker *w){
+	pthread_mutex_lock(&threadLock);
+	w->stopping = true;
+	pthread_cond_broadcast(&threadWake);
+	pthread_mutex_unlock(&threadLock);
+	if(taskPool != NULL){
+		__atomic_add_fetch(&taskPool->stopsPending, 1, __ATOMIC_RELAXED);
+		sem_post(&taskPool->pending);
+	}
+}
+
+
+/**********************************************************************
+ * Joins a thread worker once it has signalled its exit descriptor
+ *
+ * Params:	w:		The worker to reap
+ * 			ru:		Where its final resource usage is stored
+ * 			block:	true to wait for it to exit
+ * Returns:	false if it has not exited
+ *********************************************************************/
+bool threadReap(struct worker *w, struct rusage *ru, bool block){
+	unsigned long long count;
+	if(!block && read(w->pidFd, &count, sizeof(count)) != sizeof(count)){
+		return false;
+	}
+	pthread_join(w->thread, NULL);
+	*ru = w->exitUsage;
+	return true;
+}
+
+
+/**********************************************************************
+ * Finds a worker's directory under /proc. A thread's own figures are
+ * under its server's task directory; /proc/<tid> would show the whole
+ * server.
+ *
+ * Params:	w:		The worker
+ * 			dir:	Where the path is stored
+ * 			len:	The size of dir
+ *********************************************************************/
+void workerProcDir(struct worker *w, char *dir, size_t len){
+	if(self->config.backend->threads){
+		snprintf(dir, len, "/proc/self/task/%d", w->pid);
+	}
+	else{
+		snprintf(dir, len, "/proc/%d", w->pid);
+	}
+}
+
+
+/**********************************************************************
+ * Parses a kernel CPU list such as 0-3,8,10-11
+ *
+ * Params:	str:	The list
+ * 			set:	Where the CPUs are stored
+ * Returns:	false if the list is malformed or empty
+ *********************************************************************/
+bool parseCpuList(const char *str, cpu_set_t *set){
+	CPU_ZERO(set);
+	while(*str != '\0' && *str != '\n'){
+		char *end;
+		long first = strtol(str, &end, 10), last = first;
+		if(end == str){
+			return false;
+		}
+		if(*end == '-'){
+			str = end + 1;
+			last = strtol(str, &end, 10);
+			if(end == str){
+				return false;
+			}
+		}
+		if(first < 0 || last < first || last >= CPU_SETSIZE){
+			return false;
+		}
+		for(; first <= last; first++){
+			CPU_SET(first, set);
+		}
+		str = *end == ',' ? end + 1 : end;
+		if(*end != ',' && *end != '\0' && *end != '\n'){
+			return false;
+		}
+	}
+	return CPU_COUNT(set) > 0;
+}
+
+
+/**********************************************************************
+ * Reads a CPU list, or a node list in the same format, from sysfs
+ *
+ * Params:	path:	The file to read
+ * 			set:	Where the list is stored
+ * Returns:	false if the file is missing or holds no list
+ *********************************************************************/
+bool readCpuList(const char *path, cpu_set_t *set){
+	char buf[4096];
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if(fd < 0){
+		return false;
+	}
+	ssize_t n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if(n <= 0){
+		return false;
+	}
+	buf[n] = '\0';
+	return parseCpuList(buf, set);
+}
+
+
+/**********************************************************************
+ * Works out the current server's placement targets from its policy,
+ * limited to the CPUs it may run on. A pin target is one CPU; a spread
+ * target is one NUMA node; pack has a single target, the node the
+ * server itself is running on. A host without node information in
+ * sysfs counts as one node.
+ *********************************************************************/
+void setupPlacement(){
+	cpu_set_t allowed, nodes, node;
+	int i, cpu;
+	if(self->config.placement == PLACE_NONE || sched_getaffinity(0, sizeof(allowed), &allowed) < 0){
+		return;
+	}
+	self->targets = (cpu_set_t *)calloc(CPU_SETSIZE, sizeof(cpu_set_t));
+	self->targetLoad = (int *)calloc(CPU_SETSIZE, sizeof(int));
+	if(self->targets == NULL || self->targetLoad == NULL){
+		perror("calloc");
+		return;
+	}
+
+	if(self->config.placement == PLACE_PIN){
+		for(cpu = 0; cpu < CPU_SETSIZE; cpu++){
+			if(CPU_ISSET(cpu, &self->config.pinSet) && CPU_ISSET(cpu, &allowed)){
+				CPU_ZERO(&self->targets[self->numTargets]);
+				CPU_SET(cpu, &self->targets[self->numTargets]);
+				self->numTargets++;
+			}
+		}
+	}
+	else{
+		int current = sched_getcpu();
+		if(readCpuList("/sys/devices/system/node/online", &nodes)){
+			for(i = 0; i < CPU_SETSIZE; i++){
+				char path[64];
+				snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", i);
+				if(!CPU_ISSET(i, &nodes) || !readCpuList(path, &node)){
+					continue;
+				}
+				CPU_AND(&node, &node, &allowed);
+				if(CPU_COUNT(&node) == 0){
+					continue;
+				}
+				if(self->config.placement == PLACE_SPREAD){
+					self->targets[self->numTargets++] = node;
+				}
+				else if(self->numTargets == 0 || (current >= 0 && CPU_ISSET(current, &node))){
+					self->targets[0] = node;
+					self->numTargets = 1;
+				}
+			}
+		}
+		if(self->numTargets == 0){
+			self->targets[0] = allowed;
+			self->numTargets = 1;
+		}
+	}
+	if(self->numTargets == 0){
+		printf("%s: none of the pinned CPUs are available, workers are not placed\n", self->name);
+	}
+}
+
+
+/**********************************************************************
+ * Chooses the placement target with the fewest workers
+ *
+ * Returns:	The target's index, or -1 if the server places nothing
+ *********************************************************************/
+int pickTarget(){
+	int i, best = -1;
+	for(i = 0; i < self->numTargets; i++){
+		if(best < 0 || self->targetLoad[i] < self->targetLoad[best]){
+			best = i;
+		}
+	}
+	return best;
+}
+
+
+/**********************************************************************
+ * Binds a worker to its placement target's CPUs. Workers started
+ * outside a server, by comparespawn, are never bound.
+ *
+ * Params:	pid:	The worker's pid or thread id, 0 for the caller
+ * 			target:	The target's index, -1 to leave it unbound
+ *********************************************************************/
+void applyPlacement(pid_t pid, int target){
+	if(target < 0 || self == NULL || self->numTargets == 0){
+		return;
+	}
+	if(sched_setaffinity(pid, sizeof(cpu_set_t), &self->targets[target]) < 0 && errno != ESRCH){
+		perror("sched_setaffinity");
+	}
+}
+
+
+/**********************************************************************
+ * Places the current server's workers afresh, evenly over its
+ * targets, after retirements have left some targets with more than
+ * their share. Workers already on a retiring path are left alone.
+ *********************************************************************/
+void rebalance(){
+	struct worker *lists[2] = {self->workers, self->spares};
+	struct worker *w;
+	int i, moved = 0;
+	if(self->numTargets == 0){
+		printf("%s: no placement targets\n", self->name);
+		return;
+	}
+	for(i = 0; i < self->numTargets; i++){
+		self->targetLoad[i] = 0;
+	}
+	for(w = self->retiring; w; w = w->next){
+		w->target = -1;
+	}
+	for(i = 0; i < 2; i++){
+		for(w = lists[i]; w; w = w->next){
+			int target = pickTarget();
+			self->targetLoad[target]++;
+			if(target != w->target){
+				w->target = target;
+				applyPlacement(w->pid, target);
+				moved++;
+			}
+		}
+	}
+	printf("%s: %d of %d workers moved over %d targets\n", self->name, moved,
+			self->numWorkers + self->numSpares, self->numTargets);
+	fflush(stdout);
+}
+
+
+/**********************************************************************
+ * Looks up a worker backend by name
+ *
+ * Params:	name:	The backend name, e.g. fork or spawn
+ * Returns:	The backend, or NULL if there is no such backend
+ *********************************************************************/
+const struct workerBackend *findBackend(const char *name){
+	int i;
+	for(i = 0; i < NUM_BACKENDS; i++){
+		if(!strcmp(backends[i].name, name)){
+			return &backends[i];
+		}
+	}
+	return NULL;
+}
+
+
+/**********************************************************************
+ * Body of every worker, whichever backend started it. Entered with
+ * SIGINT and SIGUSR1 blocked; never returns.
+ *
+ * Params:	spare:	true to wait for promotion first
+ *********************************************************************/
+void workerMain(bool spare, int deque){
+	role = WORKER;
+	signal(SIGINT, sighandler);
+	signal(SIGTERM, sighandler);
+	if(spare){
+		waitForPromotion();
+	}
+	sigset_t intMask;
+	sigemptyset(&intMask);
+	sigaddset(&intMask, SIGINT);
+	sigaddset(&intMask, SIGTERM);
+	sigprocmask(SIG_UNBLOCK, &intMask, NULL);
+	printf("Process added\n");
+	fflush(stdout);
+	if(taskPool != NULL && deque >= 0){
+		runTasks(deque, NULL);
+	}
+	while(1){
+		pause();
+	}
+}
+
+
+/**********************************************************************
+ * Parks a spare worker until the server promotes it. A spare that is
+ * interrupted instead simply exits.
+ *********************************************************************/
+void waitForPromotion(){
+	sigset_t waitMask;
+	int signum;
+	sigemptyset(&waitMask);
+	sigaddset(&waitMask, SIGUSR1);
+	sigaddset(&waitMask, SIGINT);
+	sigaddset(&waitMask, SIGTERM);
+	while(sigwait(&waitMask, &signum) != 0 || signum != SIGUSR1){
+		if(signum == SIGINT || signum == SIGTERM){
+			exit(0);
+		}
+	}
+}
+
+
+/**********************************************************************
+ * Aborts a process for the current server, the least loaded one. The
+ * worker is asked to stop and moved to the retiring list; it finishes
+ * the task it is running, the event loop reaps it, and checkDrains()
+ * kills it if that takes longer than the drain deadline. A start that
+ * is still queued is cancelled instead.
+ *********************************************************************/
+void abortProcess(){
+	printf("serverName: %s\n", self->name);
+	//a start still waiting for the rate limit is dropped first
+	if(self->queuedStarts > 0 && self->numWorkers + self->queuedStarts > self->config.minProcs){
+		self->queuedStarts--;
+		return;
+	}
+	struct worker *w = pickVictim();
+	if(w == NULL || !(self->numWorkers > self->config.minProcs)){
+		printf("Cannot abort process!\n");
+		return;
+	}
+	w->killedAt = nowNanos();
+	self->config.backend->stop(w);
+	recordStat(STAT_KILL_WORKER, nowNanos() - w->killedAt);
+	retireWorker(w);
+}
+
+
+/**********************************************************************
+ * Picks the active worker that is cheapest to stop
+ *
+ * Returns:	The worker, or NULL if there is none
+ *********************************************************************/
+struct worker *pickVictim(){
+	struct worker *w, *best = NULL;
+	int bestLoad = 0;
+	for(w = self->workers; w && (best == NULL || bestLoad > 0); w = w->next){
+		int load = workerLoad(w);
+		if(best == NULL || load < bestLoad){
+			best = w;
+			bestLoad = load;
+		}
+	}
+	return best;
+}
+
+
+/**********************************************************************
+ * Scores a worker's load: any worker running a task scores above any
+ * idle one, and then by its share of its home deque's backlog, which
+ * the deque's other workers or thieves must pick up once it is gone
+ *
+ * Params:	w:	The worker
+ * Returns:	The score, 0 for an idle worker with nothing queued
+ *********************************************************************/
+int workerLoad(struct worker *w){
+	struct workerSlot *slot = w->slot >= 0 ? &status->workers[w->slot] : NULL;
+	int busy = slot != NULL && __atomic_load_n(&slot->busy, __ATOMIC_RELAXED);
+	return (busy ? TASK_DEQUE_SIZE : 0) + dequeInflight(w->deque) / self->dequeUsers[w->deque];
+}
+
+
+/**********************************************************************
+ * Moves a worker that has been asked to stop to the retiring list.
+ * It gives up its home deque at once, so no more tasks are queued
+ * there for it while it drains.
+ *
+ * Params:	w:	The active worker
+ *********************************************************************/
+void retireWorker(struct worker *w){
+	pthread_mutex_lock(&lock);
+	listRemove(&self->workers, w);
+	w->state = RETIRING;
+	publishWorker(w);
+	listPush(&self->retiring, w);
+	self->numWorkers--;
+	numActive--;
+	pthread_mutex_unlock(&lock);
+	self->dequeUsers[w->deque]--;
+}
+
+
+/**********************************************************************
+ * Kills retired workers that are still running past the drain
+ * deadline. A thread cannot be killed, so it is left to finish.
+ *********************************************************************/
+void checkDrains(){
+	unsigned long long now = nowNanos();
+	unsigned long long limit = self->config.drain * 1000000ULL;
+	struct worker *w;
+	for(w = self->retiring; w && !self->config.backend->threads; w = w->next){
+		if(!w->forced && w->killedAt != 0 && now - w->killedAt > limit){
+			printf("%s: worker %d still draining after %llu ms, killing it\n",
+					self->name, w->pid, (now - w->killedAt) / 1000000);
+			fflush(stdout);
+			kill(w->pid, SIGKILL);
+			w->forced = true;
+		}
+	}
+}
+
+
+/**********************************************************************
+ * Compares the spawn backends from inside the calling process. Each
+ * backend starts count spares which are then retired. The parent's
+ * minor faults are counted while it starts the worker and then writes
+ * to every page of its heap, so the copy-on-write faults that fork
+ * leaves behind are charged to the fork backend.
+ *
+ * Params:	count:		How many workers each backend starts
+ * 			heapMegs:	Megabytes of heap to allocate and touch first,
+ * 						to stand in for a heavy server image
+ *********************************************************************/
+void compareSpawn(int count, int heapMegs){
+	size_t heapLen = (size_t)heapMegs << 20;
+	long pageSize = sysconf(_SC_PAGESIZE);
+	char *heap = NULL;
+	if(heapLen > 0){
+		heap = mmap(NULL, heapLen, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if(heap == MAP_FAILED){
+			perror("mmap");
+			return;
+		}
+		memset(heap, 1, heapLen);
+	}
+
+	printf("%-8s %8s %10s %10s %12s %12s\n", "backend", "count", "avg_us", "max_us", "spawn_flt", "cow_flt");
+	int b;
+	for(b = 0; b < NUM_BACKENDS; b++){
+		unsigned long long total = 0, worst = 0;
+		long spawnFaults = 0, cowFaults = 0;
+		int i;
+		for(i = 0; i < count; i++){
+			struct worker w;
+			struct rusage before, mid, after, ru;
+			memset(&w, 0, sizeof(w));
+			w.pidFd = -1;
+			//the manager has no placement targets or worker slots
+			w.target = -1;
+			w.slot = -1;
+			getrusage(RUSAGE_SELF, &before);
+			unsigned long long start = nowNanos();
+			if(!backends[b].start(&w, true)){
+				break;
+			}
+			unsigned long long took = nowNanos() - start;
+			getrusage(RUSAGE_SELF, &mid);
+			size_t off;
+			for(off = 0; off < heapLen; off += pageSize){
+				heap[off]++;
+			}
+			getrusage(RUSAGE_SELF, &after);
+			backends[b].stop(&w);
+			backends[b].reap(&w, &ru, true);
+			if(w.pidFd >= 0){
+				close(w.pidFd);
+			}
+
+			total += took;
+			if(took > worst){
+				worst = took;
+			}
+			spawnFaults += mid.ru_minflt - before.ru_minflt;
+			cowFaults += after.ru_minflt - mid.ru_minflt;
+		}
+		if(i > 0){
+			printf("%-8s %8d %10.1f %10.1f %12.1f %12.1f\n", backends[b].name, i,
+					total / 1000.0 / i, worst / 1000.0, (double)spawnFaults / i, (double)cowFaults / i);
+		}
+	}
+	printf("(faults are per worker, counted in the parent)\n\n");
+	if(heap != NULL){
+		munmap(heap, heapLen);
+	}
+}
+
+
+/**********************************************************************
+ * Sends a typed message to a server over its command channel
+ *
+ * Params:	s:		The server to send to
+ * 			type:	The kind of message (MSG_SPAWN, MSG_RETIRE,
+ * 					MSG_STATS, MSG_RESET_STATS, MSG_SUBMIT,
+ * 					MSG_REBALANCE)
+ * 			count:	How many workers or tasks the message applies to
+ * 			arg:	The cost of each task in microseconds, for
+ * 					MSG_SUBMIT
+ * Returns:	true if the whole message was delivered
+ *********************************************************************/
+bool sendMessage(struct server *s, int type, int count, int arg){
+	struct serverMsg msg;
+	msg.type = type;
+	msg.count = count;
+	msg.arg = arg;
+	ssize_t n;
+	do{
+		n = send(s->cmdFd, &msg, sizeof(msg), MSG_NOSIGNAL);
+	}while(n < 0 && errno == EINTR);
+	if(n != sizeof(msg)){
+		perror("send");
+		return false;
+	}
+	return true;
+}
+
+
+/**********************************************************************
+ * Main loop of a server process. Reads messages from the manager and
+ * spawns or retires as many workers as each message asks for, and
+ * reaps workers as they exit. When the manager goes away the server
+ * tears down its workers and exits.
+ *
+ * Starts held back by the spawn rate limits, and then refills of the
+ * spare pool, are made one at a time, only while no event is waiting,
+ * so they never delay a command. The loop sleeps until the next token
+ * is due, or after failed starts until the next retry.
+ *********************************************************************/
+void serverLoop(){
+	while(1){
+		publishServer();
+		int timeout = -1;
+		if(self->queuedStarts > 0 || self->numSpares < self->config.spares){
+			timeout = spawnWait();
+		}
+		if(pollEvents(timeout) == 0 && timeout >= 0){
+			startQueued();
+		}
+	}
+}
+
+
+/**********************************************************************
+ * Makes the next held-back start, or else the next spare refill, if
+ * the rate limits have a token for it
+ *********************************************************************/
+void startQueued(){
+	if(self->retryAt > nowNanos() || !takeSpawnToken()){
+		return;
+	}
+	struct worker *w = NULL;
+	if(self->queuedStarts > 0){
+		//a spare may have appeared meanwhile, but the queue only ever
+		//holds starts that found none; a start that fails stays queued
+		//for the retry
+		w = startWorker(false);
+		if(w != NULL){
+			self->queuedStarts--;
+			activateWorker(w);
+		}
+	}
+	else if(self->numSpares < self->config.spares){
+		w = startWorker(true);
+		if(w != NULL){
+			listPush(&self->spares, w);
+			self->numSpares++;
+		}
+	}
+	if(w == NULL){
+		startFailed();
+	}
+}
+
+
+/**********************************************************************
+ * Parses a rate limit given as RATE[/BURST]
+ *
+ * Params:	str:	The string to parse
+ * 			rate:	Where the starts per second are stored, 0 for none
+ * 			burst:	Where the burst is stored; it defaults to the rate
+ * Returns:	false if it is not a valid rate
+ *********************************************************************/
+bool parseRate(const char *str, int *rate, int *burst){
+	char buf[32];
+	if(strlen(str) >= sizeof(buf)){
+		return false;
+	}
+	strcpy(buf, str);
+	char *slash = strchr(buf, '/');
+	if(slash != NULL){
+		*slash++ = '\0';
+	}
+	if(!parseCount(buf, rate)){
+		return false;
+	}
+	*burst = *rate;
+	return slash == NULL || (parseCount(slash, burst) && *burst > 0);
+}
+
+
+/**********************************************************************
+ * Sets a bucket's rate, starting it full
+ *
+ * Params:	b:		The bucket
+ * 			rate:	Tokens per second, 0 for no limit
+ * 			burst:	How many tokens it holds
+ *********************************************************************/
+void setBucket(struct tokenBucket *b, int rate, int burst){
+	b->tat = 0;
+	b->cost = rate > 0 ? 1000000000ULL / rate : 0;
+	b->burst = burst;
+}
+
+
+/**********************************************************************
+ * Returns how long until a bucket has a token
+ *
+ * Params:	b:		The bucket
+ * 			now:	The time, from nowNanos()
+ * Returns:	Nanoseconds to wait, 0 if a token is there now
+ *********************************************************************/
+unsigned long long bucketWait(struct tokenBucket *b, unsigned long long now){
+	if(b->cost == 0){
+		return 0;
+	}
+	unsigned long long tat = __atomic_load_n(&b->tat, __ATOMIC_ACQUIRE);
+	unsigned long long next = (tat > now ? tat : now) + b->cost;
+	unsigned long long limit = now + b->burst * b->cost;
+	return next > limit ? next - limit : 0;
+}
+
+
+/**********************************************************************
+ * Takes a token from a bucket
+ *
+ * Params:	b:		The bucket
+ * 			now:	The time, from nowNanos()
+ * Returns:	false if it is empty
+ *********************************************************************/
+bool takeToken(struct tokenBucket *b, unsigned long long now){
+	if(b->cost == 0){
+		return true;
+	}
+	unsigned long long tat = __atomic_load_n(&b->tat, __ATOMIC_ACQUIRE);
+	unsigned long long next;
+	do{
+		next = (tat > now ? tat : now) + b->cost;
+		if(next > now + b->burst * b->cost){
+			return false;
+		}
+	}while(!__atomic_compare_exchange_n(&b->tat, &tat, next, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+	return true;
+}
+
+
+/**********************************************************************
+ * Takes a token for one worker start from both the server's own bucket
+ * and the global one. The server's bucket is only checked first, and
+ * taken from once the global one has given a token, since only this
+ * process uses it.
+ *
+ * Returns:	false if either bucket is empty
+ *********************************************************************/
+bool takeSpawnToken(){
+	unsigned long long now = nowNanos();
+	if(bucketWait(&self->spawnBucket, now) > 0 || !takeToken(&status->header.spawnBucket, now)){
+		return false;
+	}
+	takeToken(&self->spawnBucket, now);
+	return true;
+}
+
+
+/**********************************************************************
+ * Returns how long serverLoop may sleep before a start can be made
+ *
+ * Returns:	Milliseconds until both buckets have a token and any
+ * 			failed start may be retried
+ *********************************************************************/
+int spawnWait(){
+	unsigned long long now = nowNanos();
+	unsigned long long wait = bucketWait(&self->spawnBucket, now);
+	unsigned long long shared = bucketWait(&status->header.spawnBucket, now);
+	if(shared > wait){
+		wait = shared;
+	}
+	if(self->retryAt > now + wait){
+		wait = self->retryAt - now;
+	}
+	return (int)((wait + 999999) / 1000000);
+}
+
+
+/**********************************************************************
+ * Holds off further starts after one failed, for START_RETRY_MS
+ * doubled with each failure in a row up to START_RETRY_MAX_MS, so a
+ * lasting failure such as a missing worker image does not spin. The
+ * next start that works clears it.
+ *********************************************************************/
+void startFailed(){
+	unsigned long long delay = START_RETRY_MAX_MS;
+	if(self->startFailures < 16 && (START_RETRY_MS << self->startFailures) < START_RETRY_MAX_MS){
+		delay = START_RETRY_MS << self->startFailures;
+	}
+	self->startFailures++;
+	self->retryAt = nowNanos() + delay * 1000000ULL;
+}
+
+
+/**********************************************************************
+ * Handles one message from the manager on the server's channel
+ *********************************************************************/
+void readMessage(){
+	struct serverMsg msg;
+	char control[CMSG_SPACE(sizeof(int))];
+	struct iovec iov = {&msg, sizeof(msg)};
+	struct msghdr header;
+	memset(&header, 0, sizeof(header));
+	header.msg_iov = &iov;
+	header.msg_iovlen = 1;
+	header.msg_control = control;
+	header.msg_controllen = sizeof(control);
+	ssize_t n = recvmsg(self->cmdFd, &header, MSG_CMSG_CLOEXEC);
+	if(n < 0 && (errno == EINTR || errno == EAGAIN)){
+		return;
+	}
+	if(n != sizeof(msg)){
+		//a kept server carries on and waits for the next manager
+		if(self->config.persistent){
+			close(self->cmdFd);
+			self->cmdFd = -1;
+			return;
+		}
+		stopServer();
+	}
+	int i;
+	if(msg.type == MSG_SPAWN){
+		for(i = 0; i < msg.count; i++){
+			createProcess();
+		}
+	}
+	else if(msg.type == MSG_RETIRE){
+		for(i = 0; i < msg.count; i++){
+			abortProcess();
+		}
+	}
+	else if(msg.type == MSG_STATS){
+		printf("%s:\n", self->name);
+		printStats();
+		fflush(stdout);
+	}
+	else if(msg.type == MSG_RESET_STATS){
+		resetStats();
+	}
+	else if(msg.type == MSG_SUBMIT){
+		submitTasks(msg.count, msg.arg);
+	}
+	else if(msg.type == MSG_REBALANCE){
+		rebalance();
+	}
+	else if(msg.type == MSG_ATTACH){
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&header);
+		if(cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS){
+			int fd;
+			memcpy(&fd, CMSG_DATA(cmsg), sizeof(fd));
+			fflush(stdout);
+			dup2(fd, STDOUT_FILENO);
+			close(fd);
+		}
+	}
+}
+
+
+/**********************************************************************
+ * Displays the current state of the Process Management System. Each
+ * server's lines are read from its slot in the shared status table, so
+ * the counts are the server's own and no server is interrupted. The
+ * usage line covers every worker the server has run, live or reaped.
+ *********************************************************************/
+void displayStatus(){
+	printf("Original servers running: %d\n", numActive);
+	int i;
+	for(i = 0; i < servers.size; i++){
+		struct server *s = servers.slots[i];
+		if(s && s != &tombstone){
+			struct serverSlot slot;
+			if(!seqRead(&slot, &status->servers[s->slot], sizeof(slot))){
+				printf("%s: status slot torn, its server died while updating it\n", s->name);
+				continue;
+			}
+			printf("%s: %d workers (min %d, max %d, %s), %d/%d spares, pool hits %d, misses %d",
+					slot.name, slot.numWorkers, slot.minProcs, slot.maxProcs, slot.backend,
+					slot.numSpares, slot.spares, slot.poolHits, slot.poolMisses);
+			if(s->config.autoscale != SCALE_NONE){
+				printf(", load %.2f", slot.load);
+			}
+			if(slot.placement[0] != '\0'){
+				printf(", %s over %d %s", slot.placement, slot.targets,
+						s->config.placement == PLACE_PIN ? "cpus" : "nodes");
+			}
+			if(slot.replaced > 0){
+				printf(", %d replaced", slot.replaced);
+			}
+			if(slot.queuedStarts > 0){
+				printf(", %d starts queued", slot.queuedStarts);
+			}
+			printf("\n");
+			printf("    cpu %.2fs user, %.2fs sys, max rss %ld KB, faults %ld minor, %ld major, "
+					"switches %ld voluntary, %ld involuntary\n",
+					slot.usage.userUsec / 1e6, slot.usage.sysUsec / 1e6, slot.usage.maxRss,
+					slot.usage.minFaults, slot.usage.majFaults,
+					slot.usage.volSwitches, slot.usage.involSwitches);
+			if(s->cgroup){
+				char dir[CGROUP_DIR_LEN];
+				unsigned long long usec = 0, throttled = 0, periods = 0, memory, pids;
+				cgroupDir(s, dir, sizeof(dir));
+				readCgroup(dir, "cpu.stat", "usage_usec", &usec);
+				readCgroup(dir, "cpu.stat", "throttled_usec", &throttled);
+				readCgroup(dir, "cpu.stat", "nr_throttled", &periods);
+				printf("    cgroup cpu %.2fs, throttled %.2fs in %llu periods",
+						usec / 1e6, throttled / 1e6, periods);
+				if(readCgroup(dir, "memory.current", NULL, &memory)){
+					printf(", memory %llu KB", memory / 1024);
+				}
+				if(readCgroup(dir, "pids.current", NULL, &pids)){
+					printf(", %llu pids", pids);
+				}
+				printf("\n");
+			}
+			if(slot.submitted > 0){
+				printf("    tasks %llu submitted, %d queued, %d running, %llu done, %llu stolen\n",
+						slot.submitted, slot.queued, slot.running, slot.done, slot.stolen);
+			}
+		}
+	}
+	printf("\n");
+}
+
+
+/**********************************************************************
+ * Hands out a zeroed record, reusing the most recently freed one or
+ * else growing the slab by another chunk
+ *
+ * Params:	sl:		The slab to allocate from
+ * 			index:	Set to the record's index in the slab
+ * Returns:	The record, or NULL if out of memory
+ *********************************************************************/
+void *slabAlloc(struct slab *sl, int *index){
+	int i;
+	if(sl->numFree > 0){
+		i = sl->freeList[--sl->numFree];
+	}
+	else{
+		if(sl->used == sl->numChunks * SLAB_CHUNK && !growSlab(sl)){
+			return NULL;
+		}
+		i = sl->used++;
+	}
+	void *record = slabRecord(sl, i);
+	memset(record, 0, sl->recordSize);
+	*index = i;
+	return record;
+}
+
+
+/**********************************************************************
+ * Hands out the record at a given index, as when a restarted manager
+ * puts adopted servers back in the slots they had. Any records
+ * skipped over go on the free list.
+ *
+ * Params:	sl:		The slab to allocate from
+ * 			index:	The record wanted
+ * Returns:	The zeroed record, or NULL if it is in use or out of memory
+ *********************************************************************/
+void *slabAllocAt(struct slab *sl, int index){
+	int i;
+	for(i = 0; i < sl->numFree && sl->freeList[i] != index; i++);
+	if(i < sl->numFree){
+		sl->freeList[i] = sl->freeList[--sl->numFree];
+	}
+	else if(index >= sl->used){
+		while(sl->used <= index){
+			if(sl->used == sl->numChunks * SLAB_CHUNK && !growSlab(sl)){
+				return NULL;
+			}
+			if(sl->used < index){
+				slabFree(sl, sl->used);
+			}
+			sl->used++;
+		}
+	}
+	else{
+		return NULL;
+	}
+	void *record = slabRecord(sl, index);
+	memset(record, 0, sl->recordSize);
+	return record;
+}
+
+
+/**********************************************************************
+ * Adds another chunk of records to a slab
+ *
+ * Params:	sl:	The slab to grow
+ * Returns:	false if out of memory
+ *********************************************************************/
+bool growSlab(struct slab *sl){
+	char **chunks = (char **)realloc(sl->chunks, (sl->numChunks + 1) * sizeof(char *));
+	if(chunks == NULL){
+		perror("realloc");
+		return false;
+	}
+	sl->chunks = chunks;
+	sl->chunks[sl->numChunks] = (char *)malloc(SLAB_CHUNK * sl->recordSize);
+	if(sl->chunks[sl->numChunks] == NULL){
+		perror("malloc");
+		return false;
+	}
+	sl->numChunks++;
+	return true;
+}
+
+
+/**********************************************************************
+ * Puts a record back on the slab's free list
+ *
+ * Params:	sl:		The slab the record came from
+ * 			index:	The record's index
+ *********************************************************************/
+void slabFree(struct slab *sl, int index){
+	if(sl->numFree == sl->freeCapacity){
+		int capacity = sl->freeCapacity ? sl->freeCapacity * 2 : SLAB_CHUNK;
+		int *freeList = (int *)realloc(sl->freeList, capacity * sizeof(int));
+		if(freeList == NULL){
+			//the record is lost to reuse but stays valid
+			perror("realloc");
+			return;
+		}
+		sl->freeList = freeList;
+		sl->freeCapacity = capacity;
+	}
+	sl->freeList[sl->numFree++] = index;
+}
+
+
+/**********************************************************************
+ * Finds a record by its index
+ *
+ * Params:	sl:		The slab holding the record
+ * 			index:	The record's index
+ * Returns:	The record
+ *********************************************************************/
+void *slabRecord(struct slab *sl, int index){
+	return sl->chunks[index / SLAB_CHUNK] + (size_t)(index % SLAB_CHUNK) * sl->recordSize;
+}
+
+
+/**********************************************************************
+ * Hashes a server name (FNV-1a); callers mask it to the registry size
+ *
+ * Params:	name:	The server name to hash
+ *********************************************************************/
+unsigned int hashName(const char *name){
+	unsigned int h = 2166136261u;
+	while(*name){
+		h ^= (unsigned char)*name++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+
+/**********************************************************************
+ * Looks up a server record by name
+ *
+ * Params:	name:	The name of the server to find
+ * Returns:	The server record, or NULL if there is no such server
+ *********************************************************************/
+struct server *findServer(const char *name){
+	if(servers.size == 0){
+		return NULL;
+	}
+	unsigned int mask = servers.size - 1;
+	unsigned int i = hashName(name) & mask;
+	int probes;
+	for(probes = 0; probes < servers.size; probes++){
+		struct server *s = servers.slots[i];
+		if(s == NULL){
+			return NULL;
+		}
+		if(s != &tombstone && !strcmp(s->name, name)){
+			return s;
+		}
+		i = (i + 1) & mask;
+	}
+	return NULL;
+}
+
+
+/**********************************************************************
+ * Rebuilds the registry at a new size, dropping its tombstones
+ *
+ * Params:	size:	The new number of hash slots, a power of two
+ * Returns:	false if the new table could not be allocated
+ *********************************************************************/
+bool growRegistry(int size){
+	struct server **slots = (struct server **)calloc(size, sizeof(struct server *));
+	if(slots == NULL){
+		perror("calloc");
+		return false;
+	}
+	int i;
+	for(i = 0; i < servers.size; i++){
+		struct server *s = servers.slots[i];
+		if(s && s != &tombstone){
+			unsigned int j = hashName(s->name) & (size - 1);
+			while(slots[j] != NULL){
+				j = (j + 1) & (size - 1);
+			}
+			slots[j] = s;
+		}
+	}
+	free(servers.slots);
+	servers.slots = slots;
+	servers.size = size;
+	servers.tombstones = 0;
+	return true;
+}
+
+
+/**********************************************************************
+ * Adds a new, empty server record to the registry. The caller must
+ * already have checked that the name is unused. The record's slab
+ * index is also its slot in the status table.
+ *
+ * Params:	name:	The name of the server to add
+ * 			slot:	The slot it must have, or -1 for any free one
+ * Returns:	The new server record, or NULL if out of memory
+ *********************************************************************/
+struct server *addServer(const char *name, int slot){
+	if((servers.count + servers.tombstones + 1) * 2 > servers.size){
+		//leave the rebuilt table at most a quarter full so it is
+		//not rebuilt again straight away
+		int size = servers.size ? servers.size : 2 * SLAB_CHUNK;
+		while((servers.count + 1) * 4 > size){
+			size *= 2;
+		}
+		if(!growRegistry(size)){
+			return NULL;
+		}
+	}
+	int index = slot;
+	struct server *s = (struct server *)(slot >= 0 ? slabAllocAt(&serverSlab, slot) : slabAlloc(&serverSlab, &index));
+	if(s == NULL){
+		return NULL;
+	}
+	if(!growStatusTable(index + 1)){
+		slabFree(&serverSlab, index);
+		return NULL;
+	}
+	s->slot = index;
+	strncpy(s->name, name, MAX_NAME_LEN - 1);
+
+	unsigned int mask = servers.size - 1;
+	unsigned int i = hashName(name) & mask;
+	while(servers.slots[i] != NULL && servers.slots[i] != &tombstone){
+		i = (i + 1) & mask;
+	}
+	if(servers.slots[i] == &tombstone){
+		servers.tombstones--;
+	}
+	servers.slots[i] = s;
+	servers.count++;
+	return s;
+}
+
+
+/**********************************************************************
+ * Removes a server record from the registry, freeing its name for
+ * reuse. The record itself lives on until freeServer().
+ *
+ * Params:	s:	The server record to remove
+ *********************************************************************/
+void removeServer(struct server *s){
+	unsigned int mask = servers.size - 1;
+	unsigned int i = hashName(s->name) & mask;
+	while(servers.slots[i] != s){
+		i = (i + 1) & mask;
+	}
+	servers.slots[i] = &tombstone;
+	servers.count--;
+	servers.tombstones++;
+}
+
+
+/**********************************************************************
+ * Frees a server record along with its worker lists
+ *
+ * Params:	s:	The server record to free
+ *********************************************************************/
+void freeServer(struct server *s){
+	while(s->workers){
+		struct worker *w = s->workers;
+		s->workers = w->next;
+		slabFree(&workerSlab, w->index);
+	}
+	while(s->spares){
+		struct worker *w = s->spares;
+		s->spares = w->next;
+		slabFree(&workerSlab, w->index);
+	}
+	while(s->retiring){
+		struct worker *w = s->retiring;
+		s->retiring = w->next;
+		slabFree(&workerSlab, w->index);
+	}
+	slabFree(&serverSlab, s->slot);
+}
+
+
+/**********************************************************************
+ * Pushes a worker onto the front of one of the server's lists
+ *
+ * Params:	head:	The list to push onto
+ * 			w:		The worker to push
+ *********************************************************************/
+void listPush(struct worker **head, struct worker *w){
+	w->prev = NULL;
+	w->next = *head;
+	if(*head != NULL){
+		(*head)->prev = w;
+	}
+	*head = w;
+}
+
+
+/**********************************************************************
+ * Unlinks a worker from one of the server's lists
+ *
+ * Params:	head:	The list the worker is on
+ * 			w:		The worker to unlink
+ *********************************************************************/
+void listRemove(struct worker **head, struct worker *w){
+	if(w->prev != NULL){
+		w->prev->next = w->next;
+	}
+	else{
+		*head = w->next;
+	}
+	if(w->next != NULL){
+		w->next->prev = w->prev;
+	}
+	w->prev = w->next = NULL;
+}
+
+
+/**********************************************************************
+ * Creates the event loop for the calling process. SIGINT, SIGTERM
+ * and SIGCHLD are blocked and read from a signalfd instead of being
+ * handled asynchronously.
+ *
+ * Returns:	false if the epoll instance or signalfd could not be made
+ *********************************************************************/
+bool setupEvents(){
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
+
+	if((epollFd = epoll_create1(EPOLL_CLOEXEC)) < 0){
+		perror("epoll_create1");
+		return false;
+	}
+	if((signalFd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) < 0){
+		perror("signalfd");
+		return false;
+	}
+	return watchFd(signalFd, &signalSource);
+}
+
+
+/**********************************************************************
+ * Adds a descriptor to the event loop
+ *
+ * Params:	fd:		The descriptor to wait on
+ * 			src:	What the descriptor is, handed back when it is ready
+ * Returns:	false if epoll will not take the descriptor
+ *********************************************************************/
+bool watchFd(int fd, struct eventSource *src){
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.ptr = src;
+	return epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev) == 0;
+}
+
+
+/**********************************************************************
+ * Watches a child through a pidfd so its exit wakes the event loop
+ * with the exact record it belongs to. If no pidfd can be had, the
+ * child is found by the SIGCHLD sweep instead.
+ *
+ * Params:	pid:	The child to watch
+ * 			pidFd:	Where the pidfd is stored, -1 if there is none
+ * 			src:	The child's event source
+ *********************************************************************/
+void watchChild(pid_t pid, int *pidFd, struct eventSource *src){
+	*pidFd = syscall(SYS_pidfd_open, pid, 0);
+	if(*pidFd >= 0 && !watchFd(*pidFd, src)){
+		close(*pidFd);
+		*pidFd = -1;
+	}
+	if(*pidFd < 0){
+		numUnwatched++;
+	}
+}
+
+
+/**********************************************************************
+ * Stops watching a child that has been reaped
+ *
+ * Params:	pidFd:	The child's pidfd, -1 if it had none
+ *********************************************************************/
+void unwatchChild(int *pidFd){
+	if(*pidFd >= 0){
+		close(*pidFd);
+	}
+	else{
+		numUnwatched--;
+	}
+	*pidFd = -1;
+}
+
+
+/**********************************************************************
+ * Waits for events and handles every one that is ready
+ *
+ * Params:	timeout:	Milliseconds to wait, -1 for no limit
+ * Returns:	The number of events handled
+ *********************************************************************/
+int pollEvents(int timeout){
+	struct epoll_event events[MAX_EVENTS];
+	int n = epoll_wait(epollFd, events, MAX_EVENTS, timeout);
+	if(n < 0){
+		if(errno != EINTR){
+			perror("epoll_wait");
+		}
+		return 0;
+	}
+	int i;
+	for(i = 0; i < n; i++){
+		struct eventSource *src = (struct eventSource *)events[i].data.ptr;
+		if(src->type == SRC_INPUT){
+			readInput();
+		}
+		else if(src->type == SRC_SIGNALS){
+			readSignals();
+		}
+		else if(src->type == SRC_CHANNEL){
+			readMessage();
+		}
+		else if(src->type == SRC_SERVER){
+			serverExited((struct server *)src->owner);
+		}
+		else if(src->type == SRC_WORKER){
+			workerExited((struct worker *)src->owner);
+		}
+		else if(src->type == SRC_TIMER){
+			serverTick();
+		}
+		else if(src->type == SRC_DEADLINE){
+			escalateStops();
+		}
+		else if(src->type == SRC_LISTEN){
+			acceptManager();
+		}
+		else if(src->type == SRC_WATCH){
+			watchTick();
+		}
+		else if(src->type == SRC_CONTROL){
+			acceptClients();
+		}
+		else if(src->type == SRC_CLIENT){
+			struct client *c = (struct client *)src->owner;
+			if(events[i].events & EPOLLOUT){
+				writeClient(c);
+			}
+			else{
+				readClient(c);
+			}
+		}
+	}
+	//registry changes are saved, and journaled commands committed,
+	//once per round, not once per command
+	if(role == MANAGER && stateDirty){
+		saveState();
+	}
+	if(role == MANAGER){
+		flushJournal();
+	}
+	return n;
+}
+
+
+/**********************************************************************
+ * Reads what stdin has ready and runs every complete line. Partial
+ * lines wait in the input buffer, so nothing is allocated.
+ *********************************************************************/
+void readInput(){
+	ssize_t n = read(STDIN_FILENO, input.data + input.len, sizeof(input.data) - 1 - input.len);
+	if(n < 0){
+		if(errno == EINTR || errno == EAGAIN){
+			return;
+		}
+		n = 0;
+	}
+	if(n == 0){
+		if(input.len > 0 && !input.discarding){
+			input.data[input.len] = '\0';
+			parseCommand(input.data);
+		}
+		input.len = 0;
+		inputClosed = true;
+		return;
+	}
+
+	input.len += n;
+	takeLines(&input, NULL);
+}
+
+
+/**********************************************************************
+ * Runs every complete line in a line buffer and keeps the partial one
+ *
+ * Params:	b:	The buffer, with the bytes just read added to len
+ * 			c:	The client the lines came from, NULL for stdin
+ *********************************************************************/
+void takeLines(struct lineBuffer *b, struct client *c){
+	char *line = b->data;
+	char *newline;
+	while((newline = memchr(line, '\n', b->data + b->len - line)) != NULL){
+		*newline = '\0';
+		if(b->discarding){
+			b->discarding = false;
+		}
+		else if(c != NULL){
+			clientCommand(c, line);
+		}
+		else{
+			parseCommand(line);
+		}
+		line = newline + 1;
+	}
+	b->len -= line - b->data;
+	memmove(b->data, line, b->len);
+
+	//a line longer than the buffer is rejected whole
+	if(b->len == (int)sizeof(b->data) - 1){
+		static const char tooLong[] = "Command too long\n";
+		if(c != NULL){
+			queueReply(c, false, tooLong, sizeof(tooLong) - 1);
+		}
+		else{
+			printf("%s", tooLong);
+		}
+		b->discarding = true;
+		b->len = 0;
+	}
+}
+
+
+/**********************************************************************
+ * Handles the signals queued on the signalfd
+ *********************************************************************/
+void readSignals(){
+	struct signalfd_siginfo info;
+	while(read(signalFd, &info, sizeof(info)) == sizeof(info)){
+		if(info.ssi_signo == SIGINT || info.ssi_signo == SIGTERM){
+			if(role == MANAGER){
+				stopManager();
+			}
+			else{
+				stopServer();
+			}
+		}
+		else if(info.ssi_signo == SIGCHLD && numUnwatched > 0){
+			sweepUnwatched();
+		}
+	}
+}
+
+
+/**********************************************************************
+ * Reaps a server whose pidfd became ready. A server that was not
+ * aborted has died on its own and is dropped from the registry.
+ *
+ * Params:	s:	The server that exited
+ *********************************************************************/
+void serverExited(struct server *s){
+	int status = 0;
+	unsigned long long start = nowNanos();
+	//an adopted server is not our child and is reaped by its new
+	//parent; its pidfd becoming ready is all there is to know
+	if(!s->adopted && waitpid(s->pid, &status, WNOHANG) <= 0){
+		return;
+	}
+	unsigned long long end = nowNanos();
+	recordStat(STAT_WAIT_SERVER, end - start);
+	if(s->killedAt != 0){
+		recordStat(STAT_SERVER_EXIT, end - s->killedAt);
+	}
+	if(s->dying){
+		if(s->batchEntry >= 0 && batchEntries != NULL){
+			batchEntries[s->batchEntry].pending = false;
+			batchEntries[s->batchEntry].end = nowNanos();
+			numPending--;
+		}
+		if(s->prev != NULL){
+			s->prev->next = s->next;
+		}
+		else{
+			dyingServers = s->next;
+		}
+		if(s->next != NULL){
+			s->next->prev = s->prev;
+		}
+	}
+	else{
+		stateDirty = true;
+		if(s->adopted){
+			printf("Server %s exited\n", s->name);
+		}
+		else if(WIFSIGNALED(status)){
+			printf("Server %s was killed by signal %d\n", s->name, WTERMSIG(status));
+		}
+		else{
+			printf("Server %s exited with status %d\n", s->name, WEXITSTATUS(status));
+		}
+		close(s->cmdFd);
+		removeServer(s);
+		pthread_mutex_lock(&lock);
+		numActive--;
+		pthread_mutex_unlock(&lock);
+	}
+	unwatchChild(&s->pidFd);
+	if(watchOut != NULL){
+		watchExit(s, status);
+	}
+	removeCgroup(s);
+	releaseServerSlot(s);
+	freeServer(s);
+}
+
+
+/**********************************************************************
+ * Reaps a worker whose pidfd became ready, adds its final resource
+ * usage to the server's total and drops it from whichever list it is on
+ *
+ * Params:	w:	The worker that exited
+ *********************************************************************/
+void workerExited(struct worker *w){
+	struct rusage ru;
+	unsigned long long start = nowNanos();
+	if(!self->config.backend->reap(w, &ru, false)){
+		return;
+	}
+	unsigned long long end = nowNanos();
+	recordStat(STAT_WAIT_WORKER, end - start);
+	if(w->killedAt != 0){
+		recordStat(STAT_WORKER_EXIT, end - w->killedAt);
+	}
+	//the rusage is final, so it replaces whatever /proc last showed
+	addRusage(&self->reaped, &ru);
+	self->usage = self->reaped;
+	struct worker *live;
+	for(live = self->workers; live; live = live->next){
+		if(live != w){
+			addUsage(&self->usage, &live->usage);
+		}
+	}
+	bool lost = w->state == ACTIVE;
+	struct workerExit *e = &self->exits[self->numExits++ % WORKER_EXITS];
+	e->time = wallMillis();
+	e->pid = w->pid;
+	e->status = w->exitStatus;
+	e->lost = lost;
+	pthread_mutex_lock(&lock);
+	if(lost){
+		printf("%s: worker %d exited unexpectedly\n", self->name, w->pid);
+		listRemove(&self->workers, w);
+		self->numWorkers--;
+		numActive--;
+	}
+	else if(w->state == SPARE){
+		listRemove(&self->spares, w);
+		self->numSpares--;
+	}
+	else{
+		listRemove(&self->retiring, w);
+	}
+	pthread_mutex_unlock(&lock);
+	unwatchChild(&w->pidFd);
+	//a worker killed in the middle of a task leaves it counted as
+	//running on its home deque
+	struct workerSlot *slot = w->slot >= 0 ? &status->workers[w->slot] : NULL;
+	if(slot != NULL && __atomic_exchange_n(&slot->busy, 0, __ATOMIC_RELAXED)){
+		__atomic_sub_fetch(&taskPool->deques[w->deque].running, 1, __ATOMIC_RELAXED);
+	}
+	releaseWorkerSlot(w);
+	if(w->state != RETIRING){
+		self->dequeUsers[w->deque]--;
+	}
+	if(w->target >= 0){
+		self->targetLoad[w->target]--;
+	}
+	slabFree(&workerSlab, w->index);
+
+	//a server being stopped sees its workers go first, with its own
+	//SIGTERM still pending, and must not replace them
+	sigset_t pending;
+	sigpending(&pending);
+	if(lost && self->numWorkers < self->config.minProcs
+			&& !sigismember(&pending, SIGTERM) && !sigismember(&pending, SIGINT)){
+		printf("%s: below %d workers, replacing it\n", self->name, self->config.minProcs);
+		self->replaced++;
+		createProcess();
+	}
+}
+
+
+/**********************************************************************
+ * Checks the children that have no pidfd after a SIGCHLD
+ *********************************************************************/
+void sweepUnwatched(){
+	int i;
+	if(role == MANAGER){
+		struct server *s, *next;
+		for(i = 0; i < servers.size; i++){
+			s = servers.slots[i];
+			if(s && s != &tombstone && s->pidFd < 0){
+				serverExited(s);
+			}
+		}
+		for(s = dyingServers; s; s = next){
+			next = s->next;
+			if(s->pidFd < 0){
+				serverExited(s);
+			}
+		}
+	}
+	else{
+		struct worker *lists[3] = {self->workers, self->spares, self->retiring};
+		struct worker *w, *next;
+		for(i = 0; i < 3; i++){
+			for(w = lists[i]; w; w = next){
+				next = w->next;
+				if(w->pidFd < 0){
+					workerExited(w);
+				}
+			}
+		}
+	}
+}
+
+
+/**********************************************************************
+ * Terminates the manager once every server has stopped
+ *********************************************************************/
+void stopManager(){
+	flushJournal();
+	if(controlPath[0] != '\0'){
+		unlink(controlPath);
+	}
+	stopServers();
+	removeStatusTable();
+	printf("I am exiting.\n");
+	exit(0);
+}
+
+
+/**********************************************************************
+ * Stops every server: each server's process group is signalled first
+ * and then all of them are reaped as they finish, so the whole host
+ * stops in about the time of its slowest worker. Servers still
+ * running after the -k grace period are killed outright, and their
+ * cgroups are removed once they are gone.
+ *********************************************************************/
+void stopServers(){
+	int i;
+	struct server *s;
+	for(i = 0; i < servers.size; i++){
+		s = servers.slots[i];
+		if(s && s != &tombstone){
+			killpg(s->pid, SIGTERM);
+			killpg(s->pid, SIGCONT);
+		}
+	}
+	if(!reapChildren(nowNanos() + killGrace * 1000000ULL)){
+		for(i = 0; i < servers.size; i++){
+			s = servers.slots[i];
+			if(s && s != &tombstone){
+				killServer(s);
+			}
+		}
+		for(s = dyingServers; s; s = s->next){
+			killServer(s);
+		}
+		reapChildren(~0ULL);
+	}
+	for(i = 0; i < servers.size; i++){
+		s = servers.slots[i];
+		if(s && s != &tombstone){
+			removeCgroup(s);
+		}
+	}
+	for(s = dyingServers; s; s = s->next){
+		removeCgroup(s);
+	}
+	if(stateFile[0] != '\0'){
+		unlink(stateFile);
+	}
+}
+
+
+/**********************************************************************
+ * Terminates the current server: every worker and spare is signalled
+ * first and then all of them are reaped together. Worker processes
+ * share the server's process group, so one killpg reaches them all;
+ * the server's own SIGTERM just lands on its blocked signalfd. The
+ * group is sent SIGCONT too, so a stopped worker sees its SIGTERM, and
+ * workers still running after the -k grace period are killed, so the
+ * server exits even when no manager is left to kill the group.
+ *********************************************************************/
+void stopServer(){
+	struct worker *w;
+	if(self->config.backend->threads){
+		for(w = self->workers; w; w = w->next){
+			self->config.backend->stop(w);
+		}
+		for(w = self->spares; w; w = w->next){
+			self->config.backend->stop(w);
+		}
+	}
+	else{
+		killpg(0, SIGTERM);
+		killpg(0, SIGCONT);
+	}
+	//thread workers end with the process
+	unsigned long long deadline = nowNanos() + killGrace * 1000000ULL;
+	bool killed = false;
+	struct signalfd_siginfo info;
+	while(1){
+		pid_t pid = waitpid(-1, NULL, WNOHANG);
+		if(pid > 0 || (pid < 0 && errno == EINTR)){
+			continue;
+		}
+		if(pid < 0){
+			break;
+		}
+		unsigned long long now = nowNanos();
+		if(!killed && now >= deadline){
+			struct worker *lists[3] = {self->workers, self->spares, self->retiring};
+			int i;
+			for(i = 0; i < 3; i++){
+				for(w = lists[i]; w; w = w->next){
+					kill(w->pid, SIGKILL);
+				}
+			}
+			killed = true;
+		}
+		struct pollfd pfd = {signalFd, POLLIN, 0};
+		poll(&pfd, 1, killed ? 1000 : (int)((deadline - now) / 1000000 + 1));
+		while(read(signalFd, &info, sizeof(info)) == sizeof(info));
+	}
+	printf("I am exiting.\n");
+	exit(0);
+}
+
+
+/**********************************************************************
+ * Sets the manager's deadline timer for the aborted server that is
+ * due to be killed first, or disarms it when none is left
+ *********************************************************************/
+void armDeadline(){
+	if(deadlineFd < 0){
+		if((deadlineFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0){
+			perror("timerfd");
+			return;
+		}
+		if(!watchFd(deadlineFd, &deadlineSource)){
+			perror("epoll_ctl");
+			close(deadlineFd);
+			deadlineFd = -1;
+			return;
+		}
+	}
+	unsigned long long first = 0;
+	struct server *s;
+	for(s = dyingServers; s; s = s->next){
+		unsigned long long due = s->killedAt + killGrace * 1000000ULL;
+		if(!s->escalated && (first == 0 || due < first)){
+			first = due;
+		}
+	}
+	//a zero it_value disarms the timer
+	struct itimerspec spec;
+	memset(&spec, 0, sizeof(spec));
+	spec.it_value.tv_sec = first / 1000000000ULL;
+	spec.it_value.tv_nsec = first % 1000000000ULL;
+	if(timerfd_settime(deadlineFd, TFD_TIMER_ABSTIME, &spec, NULL) < 0){
+		perror("timerfd_settime");
+	}
+}
+
+
+/**********************************************************************
+ * Kills the process group of every aborted server that is still
+ * running after its grace period
+ *********************************************************************/
+void escalateStops(){
+	unsigned long long expirations;
+	if(read(deadlineFd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN){
+		perror("read");
+	}
+	unsigned long long now = nowNanos();
+	struct server *s;
+	for(s = dyingServers; s; s = s->next){
+		if(!s->escalated && now >= s->killedAt + killGrace * 1000000ULL){
+			printf("Server %s did not stop in %d ms, killing it\n", s->name, killGrace);
+			killServer(s);
+			s->escalated = true;
+		}
+	}
+	armDeadline();
+}
+
+
+/**********************************************************************
+ * Reaps children as they exit, waking on SIGCHLD, until none are left
+ * or the deadline passes
+ *
+ * Params:	deadline:	When to give up, from nowNanos()
+ * Returns:	false if some children were still running at the deadline
+ *********************************************************************/
+bool reapChildren(unsigned long long deadline){
+	struct signalfd_siginfo info;
+	while(1){
+		pid_t pid = waitpid(-1, NULL, WNOHANG);
+		if(pid > 0 || (pid < 0 && errno == EINTR)){
+			continue;
+		}
+		//adopted servers are not children and raise no SIGCHLD, so
+		//while any is left the wait is cut short to look at them
+		int i, adopted = 0;
+		struct server *s;
+		for(i = 0; i < servers.size; i++){
+			s = servers.slots[i];
+			if(s && s != &tombstone && serverRunning(s)){
+				adopted++;
+			}
+		}
+		for(s = dyingServers; s; s = s->next){
+			if(serverRunning(s)){
+				adopted++;
+			}
+		}
+		if(pid < 0 && adopted == 0){
+			return true;
+		}
+		unsigned long long now = nowNanos();
+		if(now >= deadline){
+			return false;
+		}
+		unsigned long long wait = (deadline - now) / 1000000 + 1;
+		struct pollfd pfd = {signalFd, POLLIN, 0};
+		poll(&pfd, 1, adopted > 0 || wait > 1000 ? (adopted > 0 ? 10 : 1000) : (int)wait);
+		while(read(signalFd, &info, sizeof(info)) == sizeof(info));
+	}
+}
+
+
+/**********************************************************************
+ * Kills a server outright. cgroup.kill also reaches any process that
+ * has left the server's process group; without a cgroup, or on a
+ * kernel that lacks cgroup.kill, the process group gets SIGKILL.
+ *
+ * Params:	s:	The server to kill
+ *********************************************************************/
+void killServer(struct server *s){
+	if(s->cgroup){
+		char dir[CGROUP_DIR_LEN];
+		cgroupDir(s, dir, sizeof(dir));
+		if(writeCgroup(dir, "cgroup.kill", "1")){
+			return;
+		}
+	}
+	killpg(s->pid, SIGKILL);
+}
+
+
+/**********************************************************************
+ * Checks the -c cgroup directory and enables the cpu, memory and pids
+ * controllers for the servers' cgroups below it
+ *
+ * Params:	root:	The cgroup v2 directory delegated to the manager
+ * Returns:	false if the directory is not a writable cgroup
+ *********************************************************************/
+bool setupCgroups(const char *root){
+	if(strlen(root) + MAX_NAME_LEN + 32 >= sizeof(cgroupRoot)){
+		fprintf(stderr, "-c: path too long\n");
+		return false;
+	}
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/cgroup.procs", root);
+	if(access(path, W_OK) < 0){
+		perror(path);
+		return false;
+	}
+	strcpy(cgroupRoot, root);
+
+	//each controller is enabled on its own, so one the kernel lacks
+	//only matters to servers that set its limit
+	static const char *controllers[] = {"+cpu", "+memory", "+pids"};
+	int i;
+	for(i = 0; i < 3; i++){
+		writeCgroup(cgroupRoot, "cgroup.subtree_control", controllers[i]);
+	}
+	return true;
+}
+
+
+/**********************************************************************
+ * Creates a server's cgroup and applies its limits. It is made before
+ * the server is forked, so the server can join it straight away.
+ *
+ * Params:	s:	The server, with its configuration filled in
+ * Returns:	false if the cgroup could not be made or a limit not set
+ *********************************************************************/
+bool createCgroup(struct server *s){
+	char dir[CGROUP_DIR_LEN];
+	cgroupDir(s, dir, sizeof(dir));
+	//an empty cgroup left by an earlier server of this name and slot
+	//is replaced, so none of its limits carry over
+	if(mkdir(dir, 0755) < 0 && (errno != EEXIST || rmdir(dir) < 0 || mkdir(dir, 0755) < 0)){
+		printf("Cannot create cgroup %s: %s\n", dir, strerror(errno));
+		return false;
+	}
+	s->cgroup = true;
+
+	const char *files[3] = {"cpu.max", "memory.max", "pids.max"};
+	const char *limits[3] = {s->config.cpuMax, s->config.memMax, s->config.pidsMax};
+	int i;
+	for(i = 0; i < 3; i++){
+		if(limits[i][0] != '\0' && !writeCgroup(dir, files[i], limits[i])){
+			printf("Cannot set %s of %s: %s\n", files[i], dir, strerror(errno));
+			removeCgroup(s);
+			return false;
+		}
+	}
+	return true;
+}
+
+
+/**********************************************************************
+ * Removes a server's cgroup once the server has been reaped. Anything
+ * still inside escaped the server's process group, such as a worker's
+ * own children; it is killed, and cgroup.events is watched until the
+ * cgroup empties.
+ *
+ * Params:	s:	The server whose cgroup is removed
+ *********************************************************************/
+void removeCgroup(struct server *s){
+	if(!s->cgroup){
+		return;
+	}
+	s->cgroup = false;
+	char dir[CGROUP_DIR_LEN];
+	cgroupDir(s, dir, sizeof(dir));
+	if(rmdir(dir) == 0 || errno == ENOENT){
+		return;
+	}
+	if(errno == EBUSY){
+		writeCgroup(dir, "cgroup.kill", "1");
+		char path[CGROUP_DIR_LEN + 16], buf[64];
+		snprintf(path, sizeof(path), "%s/cgroup.events", dir);
+		int fd = open(path, O_RDONLY | O_CLOEXEC);
+		unsigned long long deadline = nowNanos() + 1000000000ULL;
+		while(rmdir(dir) < 0 && errno == EBUSY && nowNanos() < deadline){
+			struct pollfd pfd = {fd, POLLPRI, 0};
+			poll(&pfd, fd >= 0 ? 1 : 0, 10);
+			//rereading rearms the notification
+			if(fd >= 0 && pread(fd, buf, sizeof(buf), 0) < 0){
+				break;
+			}
+		}
+		if(fd >= 0){
+			close(fd);
+		}
+		if(access(dir, F_OK) < 0){
+			return;
+		}
+	}
+	printf("Cannot remove cgroup %s: %s\n", dir, strerror(errno));
+}
+
+
+/**********************************************************************
+ * Finds a server's cgroup directory, NAME.SLOT under the root. A
+ * server's slot is not reused until it is reaped, so an aborted server
+ * still being stopped never shares a cgroup with a new one that took
+ * its name.
+ *
+ * Params:	s:		The server
+ * 			dir:	Where the path is stored
+ * 			len:	The size of dir, CGROUP_DIR_LEN so it always fits
+ *********************************************************************/
+void cgroupDir(struct server *s, char *dir, size_t len){
+	snprintf(dir, len, "%s/%s.%d", cgroupRoot, s->name, s->slot);
+}
+
+
+/**********************************************************************
+ * Writes one value to a cgroup interface file
+ *
+ * Params:	dir:	The cgroup directory
+ * 			file:	The interface file, e.g. cpu.max
+ * 			value:	What to write
+ * Returns:	false if the write failed, with errno set
+ *********************************************************************/
+bool writeCgroup(const char *dir, const char *file, const char *value){
+	char path[CGROUP_DIR_LEN + 32];
+	snprintf(path, sizeof(path), "%s/%s", dir, file);
+	int fd = open(path, O_WRONLY | O_CLOEXEC);
+	if(fd < 0){
+		return false;
+	}
+	ssize_t n = write(fd, value, strlen(value));
+	int err = errno;
+	close(fd);
+	errno = err;
+	return n == (ssize_t)strlen(value);
+}
+
+
+/**********************************************************************
+ * Reads a number from a cgroup interface file
+ *
+ * Params:	dir:	The cgroup directory
+ * 			file:	The interface file, e.g. memory.current
+ * 			key:	The line to read in a keyed file such as cpu.stat,
+ * 					or NULL for a file holding a single number
+ * 			value:	Where the number is stored
+ * Returns:	false if the file or key is missing or holds "max"
+ *********************************************************************/
+bool readCgroup(const char *dir, const char *file, const char *key, unsigned long long *value){
+	char path[CGROUP_DIR_LEN + 32], name[64];
+	snprintf(path, sizeof(path), "%s/%s", dir, file);
+	FILE *f = fopen(path, "r");
+	if(f == NULL){
+		return false;
+	}
+	bool found = false;
+	if(key == NULL){
+		found = fscanf(f, "%llu", value) == 1;
+	}
+	else{
+		while(!found && fscanf(f, "%63s %llu", name, value) == 2){
+			found = !strcmp(name, key);
+		}
+	}
+	fclose(f);
+	return found;
+}
+
+
+/**********************************************************************
+ * Checks a cgroup limit: "max", or a number with at most one of the
+ * given unit suffixes
+ *
+ * Params:	value:		The limit as given
+ * 			suffixes:	The unit letters allowed after the number
+ * Returns:	true if the kernel should accept it
+ *********************************************************************/
+bool validLimit(const char *value, const char *suffixes){
+	if(!strcmp(value, "max")){
+		return true;
+	}
+	size_t digits = strspn(value, "0123456789");
+	if(digits == 0 || digits > 15){
+		return false;
+	}
+	return value[digits] == '\0' || (value[digits + 1] == '\0' && strchr(suffixes, value[digits]) != NULL);
+}
+
+
+/**********************************************************************
+ * Writes the registry to the -s state file. The file is replaced
+ * whole by a rename, so a crash never leaves half of one behind.
+ *********************************************************************/
+void saveState(){
+	stateDirty = false;
+	if(stateFile[0] == '\0'){
+		return;
+	}
+	char tmp[PATH_MAX + 8];
+	snprintf(tmp, sizeof(tmp), "%s.tmp", stateFile);
+	FILE *f = fopen(tmp, "wb");
+	if(f == NULL){
+		perror(tmp);
+		return;
+	}
+	struct stateHeader header;
+	memset(&header, 0, sizeof(header));
+	header.magic = STATE_MAGIC;
+	header.recordSize = sizeof(struct stateRecord);
+	header.count = servers.count;
+	strcpy(header.statusName, statusName);
+	fwrite(&header, sizeof(header), 1, f);
+
+	int i;
+	for(i = 0; i < servers.size; i++){
+		struct server *s = servers.slots[i];
+		if(s && s != &tombstone){
+			struct stateRecord r;
+			memset(&r, 0, sizeof(r));
+			strcpy(r.name, s->name);
+			r.pid = s->pid;
+			r.startTime = s->startTime;
+			r.slot = s->slot;
+			r.backend = s->config.backend - backends;
+			r.cgroup = s->cgroup;
+			r.config = s->config;
+			fwrite(&r, sizeof(r), 1, f);
+		}
+	}
+	bool failed = ferror(f);
+	if(fclose(f) != 0 || failed || rename(tmp, stateFile) < 0){
+		perror(stateFile);
+		unlink(tmp);
+	}
+}
+
+
+/**********************************************************************
+ * Starts the manager from the -s state file: the status table named
+ * there is mapped again and every server still running is adopted.
+ * The slots of servers that have gone are cleared. Without a state
+ * file the manager starts afresh.
+ *
+ * Returns:	false if the state file or status table is unusable
+ *********************************************************************/
+bool restoreState(){
+	FILE *f = fopen(stateFile, "rb");
+	if(f == NULL){
+		if(errno != ENOENT){
+			perror(stateFile);
+			return false;
+		}
+		return createStatusTable();
+	}
+	struct stateHeader header;
+	if(fread(&header, sizeof(header), 1, f) != 1 || header.magic != STATE_MAGIC
+			|| header.recordSize != sizeof(struct stateRecord)){
+		fprintf(stderr, "%s is not a state file of this version\n", stateFile);
+		fclose(f);
+		return false;
+	}
+	header.statusName[sizeof(header.statusName) - 1] = '\0';
+	if(!openStatusTable(header.statusName) && !createStatusTable()){
+		fclose(f);
+		return false;
+	}
+
+	struct stateRecord r;
+	int i, adopted = 0;
+	for(i = 0; i < header.count && fread(&r, sizeof(r), 1, f) == 1; i++){
+		r.name[MAX_NAME_LEN - 1] = '\0';
+		if(r.backend < 0 || r.backend >= NUM_BACKENDS || r.slot < 0 || findServer(r.name) != NULL){
+			continue;
+		}
+		r.config.backend = &backends[r.backend];
+		if(adoptServer(&r)){
+			adopted++;
+		}
+		else if((unsigned int)r.slot < status->header.numServerSlots){
+			struct server gone;
+			memset(&gone, 0, sizeof(gone));
+			gone.slot = r.slot;
+			releaseServerSlot(&gone);
+		}
+	}
+	fclose(f);
+	printf("Adopted %d of %d servers from %s\n", adopted, header.count, stateFile);
+	stateDirty = true;
+	return true;
+}
+
+
+/**********************************************************************
+ * Maps the status table left by an earlier manager
+ *
+ * Params:	name:	The table's shared memory name
+ * Returns:	false if it is gone or not a status table
+ *********************************************************************/
+bool openStatusTable(const char *name){
+	int fd = shm_open(name, O_RDWR | O_CLOEXEC, 0);
+	if(fd < 0){
+		return false;
+	}
+	struct stat st;
+	if(fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(struct statusTable)){
+		close(fd);
+		return false;
+	}
+	struct statusTable *table = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if(table == MAP_FAILED){
+		close(fd);
+		return false;
+	}
+	if(table->header.magic != STATUS_MAGIC || sizeof(struct statusTable)
+			+ table->header.numServerSlots * sizeof(struct serverSlot) != (size_t)st.st_size){
+		munmap(table, st.st_size);
+		close(fd);
+		return false;
+	}
+	status = table;
+	statusFd = fd;
+	strcpy(statusName, name);
+	status->header.managerPid = getpid();
+	return true;
+}
+
+
+/**********************************************************************
+ * Takes over one server from the state file if it is still the same
+ * process. Its exit is watched through a pidfd, which holds on to
+ * that exact process, and its channel is reopened through the socket
+ * it listens on. A server that cannot be reached is still adopted so
+ * that it can be aborted, and its slot is kept.
+ *
+ * Params:	r:	The server's saved record
+ * Returns:	false if the server has gone
+ *********************************************************************/
+bool adoptServer(const struct stateRecord *r){
+	unsigned long long startTime;
+	if(!readStartTime(r->pid, &startTime) || startTime != r->startTime){
+		return false;
+	}
+	struct server *s = addServer(r->name, r->slot);
+	if(s == NULL){
+		return false;
+	}
+	s->config = r->config;
+	s->pid = r->pid;
+	s->startTime = r->startTime;
+	s->cgroup = r->cgroup;
+	s->adopted = true;
+	s->cmdFd = -1;
+	s->batchEntry = -1;
+	s->exitSource.type = SRC_SERVER;
+	s->exitSource.owner = s;
+	watchChild(s->pid, &s->pidFd, &s->exitSource);
+	//the pid may have been reused between the check and the pidfd
+	if(s->pidFd < 0 || !readStartTime(s->pid, &startTime) || startTime != s->startTime){
+		unwatchChild(&s->pidFd);
+		removeServer(s);
+		slabFree(&serverSlab, s->slot);
+		return false;
+	}
+
+	struct sockaddr_un addr;
+	socklen_t len = serverAddress(s->pid, &addr);
+	int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if(fd < 0 || connect(fd, (struct sockaddr *)&addr, len) < 0){
+		printf("Cannot reach server %s: %s\n", s->name, strerror(errno));
+		if(fd >= 0){
+			close(fd);
+		}
+	}
+	else{
+		s->cmdFd = fd;
+		sendAttach(s);
+	}
+	pthread_mutex_lock(&lock);
+	numActive++;
+	pthread_mutex_unlock(&lock);
+	return true;
+}
+
+
+/**********************************************************************
+ * Reads when a process started, in clock ticks after boot
+ *
+ * Params:	pid:		The process
+ * 			startTime:	Where the start time is stored
+ * Returns:	false if there is no such process, or it has exited
+ *********************************************************************/
+bool readStartTime(pid_t pid, unsigned long long *startTime){
+	char path[64], buf[1024];
+	snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if(fd < 0){
+		return false;
+	}
+	ssize_t n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if(n <= 0){
+		return false;
+	}
+	buf[n] = '\0';
+	//the command name may hold spaces, so fields count from its ')';
+	//a zombie has already exited and waits only for its parent
+	char *p = strrchr(buf, ')');
+	char state;
+	return p != NULL && sscanf(p + 2, "%c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %*u %*u %*d %*d %*d %*d %*d %*d %llu",
+			&state, startTime) == 2 && state != 'Z' && state != 'X';
+}
+
+
+/**********************************************************************
+ * Builds the abstract socket address a kept server listens on
+ *
+ * Params:	pid:	The server's pid
+ * 			addr:	Where the address is stored
+ * Returns:	The address length
+ *********************************************************************/
+socklen_t serverAddress(pid_t pid, struct sockaddr_un *addr){
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	int n = snprintf(addr->sun_path + 1, sizeof(addr->sun_path) - 1, "processManager.%d", pid);
+	return offsetof(struct sockaddr_un, sun_path) + 1 + n;
+}
+
+
+/**********************************************************************
+ * Opens the current server's socket for a restarted manager
+ *
+ * Returns:	false if the socket could not be made
+ *********************************************************************/
+bool listenForManager(){
+	struct sockaddr_un addr;
+	socklen_t len = serverAddress(getpid(), &addr);
+	listenFd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if(listenFd < 0 || bind(listenFd, (struct sockaddr *)&addr, len) < 0 || listen(listenFd, 4) < 0
+			|| !watchFd(listenFd, &listenSource)){
+		perror("listen");
+		return false;
+	}
+	return true;
+}
+
+
+/**********************************************************************
+ * Accepts a new manager. Only a process of the same user is taken,
+ * and its channel replaces whatever the server had before.
+ *********************************************************************/
+void acceptManager(){
+	int fd;
+	while((fd = accept4(listenFd, NULL, NULL, SOCK_CLOEXEC)) >= 0){
+		struct ucred cred;
+		socklen_t len = sizeof(cred);
+		if(getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0 || cred.uid != getuid()
+				|| !watchFd(fd, &channelSource)){
+			close(fd);
+			continue;
+		}
+		if(self->cmdFd >= 0){
+			close(self->cmdFd);
+		}
+		self->cmdFd = fd;
+	}
+}
+
+
+/**********************************************************************
+ * Hands the manager's stdout to an adopted server, so the server's
+ * output shows up with the manager that now runs it
+ *
+ * Params:	s:	The adopted server
+ * Returns:	true if the message was delivered
+ *********************************************************************/
+bool sendAttach(struct server *s){
+	struct serverMsg msg = {MSG_ATTACH, 0, 0};
+	char control[CMSG_SPACE(sizeof(int))];
+	struct iovec iov = {&msg, sizeof(msg)};
+	struct msghdr header;
+	memset(&header, 0, sizeof(header));
+	memset(control, 0, sizeof(control));
+	header.msg_iov = &iov;
+	header.msg_iovlen = 1;
+	header.msg_control = control;
+	header.msg_controllen = sizeof(control);
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&header);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	int fd = STDOUT_FILENO;
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(fd));
+	fflush(stdout);
+	if(sendmsg(s->cmdFd, &header, MSG_NOSIGNAL) != sizeof(msg)){
+		perror("sendmsg");
+		return false;
+	}
+	return true;
+}
+
+
+/**********************************************************************
+ * Checks whether an adopted server is still running. Servers the
+ * manager forked itself are followed through waitpid instead.
+ *
+ * Params:	s:	The server
+ * Returns:	true if it is adopted and has not exited
+ *********************************************************************/
+bool serverRunning(struct server *s){
+	if(!s->adopted || s->pidFd < 0){
+		return false;
+	}
+	struct pollfd pfd = {s->pidFd, POLLIN, 0};
+	return poll(&pfd, 1, 0) == 0;
+}
+
+
+/**********************************************************************
+ * Opens the -j journal for appending, creating it if need be. A record
+ * torn by a crash is cut off, so new records follow the last good one.
+ *
+ * Params:	path:	The journal file
+ * Returns:	false if it cannot be used
+ *********************************************************************/
+bool openJournal(const char *path){
+	int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if(fd < 0){
+		perror(path);
+		return false;
+	}
+	unsigned int magic = JOURNAL_MAGIC;
+	off_t end = lseek(fd, 0, SEEK_END);
+	if(end == 0){
+		if(write(fd, &magic, sizeof(magic)) != sizeof(magic) || fdatasync(fd) < 0){
+			perror(path);
+			close(fd);
+			return false;
+		}
+		journalFd = fd;
+		return true;
+	}
+
+	lseek(fd, 0, SEEK_SET);
+	FILE *f = fdopen(dup(fd), "r");
+	if(f == NULL){
+		perror(path);
+		close(fd);
+		return false;
+	}
+	struct journalRecord r;
+	char text[MAX_STR_LEN];
+	long good = sizeof(magic);
+	if(fread(&magic, sizeof(magic), 1, f) != 1 || magic != JOURNAL_MAGIC){
+		printf("%s is not a journal\n", path);
+		fclose(f);
+		close(fd);
+		return false;
+	}
+	while(readRecord(f, &r, text)){
+		good = ftell(f);
+	}
+	fclose(f);
+	if(good < end){
+		printf("%s: dropping %ld bytes after the last whole record\n", path, (long)end - good);
+		if(ftruncate(fd, good) < 0){
+			perror(path);
+			close(fd);
+			return false;
+		}
+	}
+	lseek(fd, 0, SEEK_END);
+	journalFd = fd;
+	return true;
+}
+
+
+/**********************************************************************
+ * Adds a command to the journal. Records wait in journalBuf and are
+ * committed together by flushJournal() at the end of the event loop
+ * round, or sooner if the buffer fills.
+ *
+ * Params:	text:	The command, its words joined by single spaces
+ *********************************************************************/
+void journalCommand(const char *text){
+	struct journalRecord r;
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	r.time = (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	r.length = strlen(text);
+	r.crc = journalCrc(journalCrc(0, &r.time, sizeof(r.time)), text, r.length);
+	if(journalLen + sizeof(r) + r.length > sizeof(journalBuf)){
+		flushJournal();
+	}
+	memcpy(journalBuf + journalLen, &r, sizeof(r));
+	memcpy(journalBuf + journalLen + sizeof(r), text, r.length);
+	journalLen += sizeof(r) + r.length;
+}
+
+
+/**********************************************************************
+ * Commits the buffered journal records with one write and one
+ * fdatasync
+ *********************************************************************/
+void flushJournal(){
+	if(journalLen == 0){
+		return;
+	}
+	size_t done = 0;
+	while(done < journalLen){
+		ssize_t n = write(journalFd, journalBuf + done, journalLen - done);
+		if(n < 0 && errno == EINTR){
+			continue;
+		}
+		if(n <= 0){
+			perror("journal");
+			break;
+		}
+		done += n;
+	}
+	if(fdatasync(journalFd) < 0){
+		perror("journal");
+	}
+	journalLen = 0;
+}
+
+
+/**********************************************************************
+ * Reads the next journal record
+ *
+ * Params:	f:		The journal, positioned at a record
+ * 			r:		Where the record header is stored
+ * 			text:	Buffer of MAX_STR_LEN characters for the command
+ * Returns:	false at the end of the journal or at a damaged record
+ *********************************************************************/
+bool readRecord(FILE *f, struct journalRecord *r, char *text){
+	if(fread(r, sizeof(*r), 1, f) != 1 || r->length >= MAX_STR_LEN
+			|| fread(text, 1, r->length, f) != r->length){
+		return false;
+	}
+	text[r->length] = '\0';
+	return journalCrc(journalCrc(0, &r->time, sizeof(r->time)), text, r->length) == r->crc;
+}
+
+
+/**********************************************************************
+ * Computes a CRC-32 (the IEEE polynomial, as zlib and Ethernet use)
+ *
+ * Params:	crc:	The CRC so far, 0 to start
+ * 			data:	The bytes to add
+ * 			len:	How many there are
+ * Returns:	The updated CRC
+ *********************************************************************/
+unsigned int journalCrc(unsigned int crc, const void *data, size_t len){
+	static unsigned int table[256];
+	if(table[1] == 0){
+		unsigned int i, j;
+		for(i = 0; i < 256; i++){
+			unsigned int c = i;
+			for(j = 0; j < 8; j++){
+				c = c & 1 ? 0xedb88320U ^ (c >> 1) : c >> 1;
+			}
+			table[i] = c;
+		}
+	}
+	const unsigned char *p = data;
+	crc = ~crc;
+	while(len-- > 0){
+		crc = table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	}
+	return ~crc;
+}
+
+
+/**********************************************************************
+ * Writes a journal out as plain command lines, which -b can run again,
+ * e.g. to time a recorded trace against a new build
+ *
+ * Params:	path:	The journal file
+ * Returns:	false if it could not be read or is damaged
+ *********************************************************************/
+bool dumpJournal(const char *path){
+	FILE *f = fopen(path, "r");
+	if(f == NULL){
+		perror(path);
+		return false;
+	}
+	unsigned int magic;
+	struct journalRecord r;
+	char text[MAX_STR_LEN];
+	if(fread(&magic, sizeof(magic), 1, f) != 1 || magic != JOURNAL_MAGIC){
+		fprintf(stderr, "%s is not a journal\n", path);
+		fclose(f);
+		return false;
+	}
+	long good = ftell(f);
+	while(readRecord(f, &r, text)){
+		printf("%s\n", text);
+		good = ftell(f);
+	}
+	fseek(f, 0, SEEK_END);
+	bool whole = ftell(f) == good;
+	if(!whole){
+		fprintf(stderr, "%s: damaged record at byte %ld\n", path, good);
+	}
+	fclose(f);
+	return whole;
+}
+
+
+/**********************************************************************
+ * Rebuilds the server layout a journal describes. The journal is
+ * folded first: each server that was created and not aborted is kept
+ * with its createserver line and its net createprocess and
+ * abortprocess count, held between its minProcs and maxProcs after
+ * each command the way the server itself holds it. Every server is then forked before any is sent
+ * its extra workers, and none is waited on, so all of them start their
+ * workers side by side. The replayed commands are journaled like any
+ * others, unless this is the journal being written to.
+ *
+ * Params:	path:	The journal file
+ * Returns:	false if it could not be read
+ *********************************************************************/
+bool replayJournal(const char *path){
+	FILE *f = fopen(path, "r");
+	if(f == NULL){
+		perror(path);
+		return false;
+	}
+	struct stat st, own;
+	unsigned int magic;
+	if(fstat(fileno(f), &st) < 0 || fread(&magic, sizeof(magic), 1, f) != 1 || magic != JOURNAL_MAGIC){
+		printf("%s is not a journal\n", path);
+		fclose(f);
+		return false;
+	}
+	//the journal holds at most one server per record
+	struct hsearch_data names;
+	memset(&names, 0, sizeof(names));
+	size_t maxServers = st.st_size / (sizeof(struct journalRecord) + strlen(commandList[0])) + 1;
+	struct replayServer *list = calloc(maxServers, sizeof(struct replayServer));
+	char (*keys)[MAX_NAME_LEN] = calloc(maxServers, MAX_NAME_LEN);
+	if(list == NULL || keys == NULL || !hcreate_r(maxServers * 2, &names)){
+		perror("replay");
+		free(list);
+		free(keys);
+		fclose(f);
+		return false;
+	}
+
+	struct journalRecord r;
+	char text[MAX_STR_LEN], words[MAX_STR_LEN];
+	int numServers = 0, numRecords = 0;
+	long good = ftell(f);
+	while(readRecord(f, &r, text)){
+		good = ftell(f);
+		numRecords++;
+		char *argv[5], *save;
+		int argc = 0;
+		strcpy(words, text);
+		char *pch = strtok_r(words, " ", &save);
+		while(pch != NULL && argc < 5){
+			argv[argc++] = pch;
+			pch = strtok_r(NULL, " ", &save);
+		}
+		int name = !strcmp(argv[0], commandList[0]) ? 3 : 1;
+		if(argc <= name || strlen(argv[name]) >= MAX_NAME_LEN){
+			continue;
+		}
+		ENTRY item = {argv[name], NULL}, *found = NULL;
+		hsearch_r(item, FIND, &found, &names);
+		struct replayServer *s = found ? (struct replayServer *)found->data : NULL;
+		int count = 1;
+		if(!strcmp(argv[0], commandList[0])){
+			if(s == NULL){
+				strcpy(keys[numServers], argv[name]);
+				item.key = keys[numServers];
+				item.data = s = &list[numServers++];
+				hsearch_r(item, ENTER, &found, &names);
+			}
+			int minProcs = 0, maxProcs = 0;
+			parseCount(argv[1], &minProcs);
+			parseCount(argv[2], &maxProcs);
+			strcpy(s->line, text);
+			s->extra = 0;
+			s->room = maxProcs - minProcs;
+			s->live = true;
+		}
+		else if(s == NULL || !s->live){
+			continue;
+		}
+		else if(!strcmp(argv[0], commandList[2])){
+			s->live = false;
+		}
+		else if((!strcmp(argv[0], commandList[1]) || !strcmp(argv[0], commandList[3]))
+				&& (argc < 3 || parseCount(argv[2], &count))){
+			//the server stops at maxProcs and at minProcs on each command, so the count does too
+			s->extra += argv[0][0] == 'c' ? count : -count;
+			if(s->extra > s->room){
+				s->extra = s->room;
+			}
+			else if(s->extra < 0){
+				s->extra = 0;
+			}
+		}
+	}
+	bool whole = good == st.st_size;
+	fclose(f);
+	hdestroy_r(&names);
+
+	journalMuted = journalFd >= 0 && fstat(journalFd, &own) == 0
+			&& own.st_dev == st.st_dev && own.st_ino == st.st_ino;
+	int i, live = 0;
+	unsigned long long start = nowNanos();
+	for(i = 0; i < numServers; i++){
+		if(list[i].live){
+			strcpy(text, list[i].line);
+			list[i].live = parseCommand(text);
+			live += list[i].live;
+		}
+	}
+	for(i = 0; i < numServers; i++){
+		if(list[i].live && list[i].extra > 0){
+			char *name = strchr(strchr(strchr(list[i].line, ' ') + 1, ' ') + 1, ' ') + 1;
+			snprintf(text, sizeof(text), "%s %.*s %d", commandList[1], (int)strcspn(name, " "), name, list[i].extra);
+			parseCommand(text);
+		}
+	}
+	journalMuted = false;
+	printf("Replayed %d records from %s%s: %d servers started in %llu usec\n", numRecords, path,
+			whole ? "" : " (stopped at a damaged record)", live, (nowNanos() - start) / 1000);
+	fflush(stdout);
+	free(list);
+	free(keys);
+	return true;
+}
+
+
+/**********************************************************************
+ * Opens the -S control socket. Any number of clients may connect and
+ * send the same commands as stdin, one per line, without waiting for
+ * each reply. Only processes of the same user are served.
+ *
+ * Params:	path:	Where to make the socket; a stale one is replaced
+ * Returns:	false if the socket could not be made
+ *********************************************************************/
+bool openControl(const char *path){
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if(strlen(path) >= sizeof(addr.sun_path)){
+		printf("-S: path too long\n");
+		return false;
+	}
+	strcpy(addr.sun_path, path);
+	controlFd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if(controlFd < 0){
+		perror("socket");
+		return false;
+	}
+	//a socket left by a manager that died is refused, not reused
+	unlink(path);
+	mode_t mask = umask(0077);
+	int bound = bind(controlFd, (struct sockaddr *)&addr, sizeof(addr));
+	umask(mask);
+	if(bound < 0 || listen(controlFd, SOMAXCONN) < 0 || !watchFd(controlFd, &controlSource)){
+		perror(path);
+		close(controlFd);
+		controlFd = -1;
+		return false;
+	}
+	strcpy(controlPath, path);
+	return true;
+}
+
+
+/**********************************************************************
+ * Accepts every client waiting on the control socket
+ *********************************************************************/
+void acceptClients(){
+	int fd;
+	while((fd = accept4(controlFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0){
+		struct ucred cred;
+		socklen_t len = sizeof(cred);
+		struct client *c = NULL;
+		if(getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0 || cred.uid != getuid()
+				|| (c = (struct client *)calloc(1, sizeof(struct client))) == NULL){
+			close(fd);
+			continue;
+		}
+		c->fd = fd;
+		c->source.type = SRC_CLIENT;
+		c->source.owner = c;
+		if(!watchFd(fd, &c->source)){
+			perror("epoll_ctl");
+			close(fd);
+			free(c);
+			continue;
+		}
+		c->next = clients;
+		if(clients != NULL){
+			clients->prev = c;
+		}
+		clients = c;
+	}
+}
+
+
+/**********************************************************************
+ * Reads what a client has sent and runs every complete line, and the
+ * last one unterminated when it hangs up. A client that hangs up still
+ * gets the replies to what it sent first.
+ *
+ * Params:	c:	The client
+ *********************************************************************/
+void readClient(struct client *c){
+	ssize_t n = read(c->fd, c->in.data + c->in.len, sizeof(c->in.data) - 1 - c->in.len);
+	if(n < 0 && (errno == EINTR || errno == EAGAIN)){
+		return;
+	}
+	if(n <= 0){
+		if(n == 0 && c->in.len > 0 && !c->in.discarding){
+			c->in.data[c->in.len] = '\0';
+			clientCommand(c, c->in.data);
+		}
+		c->in.len = 0;
+		c->closing = true;
+		writeClient(c);
+		return;
+	}
+	c->in.len += n;
+	takeLines(&c->in, c);
+	writeClient(c);
+}
+
+
+/**********************************************************************
+ * Runs one command for a client. Whatever the manager prints while it
+ * runs, on stdout or stderr, becomes the reply; output that servers
+ * and workers print themselves, and messages about servers exiting
+ * later, still go to the manager's own stdout.
+ *
+ * Params:	c:		The client
+ * 			line:	The command
+ *********************************************************************/
+void clientCommand(struct client *c, char *line){
+	char *body = NULL;
+	size_t len = 0;
+	FILE *reply = open_memstream(&body, &len);
+	if(reply == NULL){
+		perror("open_memstream");
+		return;
+	}
+	fflush(stdout);
+	fflush(stderr);
+	stdout = stderr = reply;
+	commandClient = c;
+	bool ok = parseCommand(line);
+	commandClient = NULL;
+	restoreConsole();
+	fclose(reply);
+	queueReply(c, ok, body, len);
+	free(body);
+	//detach only returns to here to answer first; the reply is
+	//written out blocking, within a second, then the manager exits
+	if(detached){
+		struct timeval limit = {1, 0};
+		setsockopt(c->fd, SOL_SOCKET, SO_SNDTIMEO, &limit, sizeof(limit));
+		fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) & ~O_NONBLOCK);
+		writeClient(c);
+		exit(0);
+	}
+}
+
+
+/**********************************************************************
+ * Queues a reply for a client
+ *
+ * Params:	c:		The client
+ * 			ok:		Whether the command succeeded
+ * 			body:	What it printed
+ * 			len:	The length of body
+ *********************************************************************/
+void queueReply(struct client *c, bool ok, const char *body, size_t len){
+	char header[32];
+	int headerLen = snprintf(header, sizeof(header), "%s %zu\n", ok ? "ok" : "failed", len);
+	size_t need = c->outLen + headerLen + len;
+	if(need > c->outSize){
+		size_t size = c->outSize ? c->outSize : 4096;
+		while(size < need){
+			size *= 2;
+		}
+		char *out = (char *)realloc(c->out, size);
+		if(out == NULL){
+			perror("realloc");
+			c->closing = true;
+			return;
+		}
+		c->out = out;
+		c->outSize = size;
+	}
+	memcpy(c->out + c->outLen, header, headerLen);
+	memcpy(c->out + c->outLen + headerLen, body, len);
+	c->outLen = need;
+}
+
+
+/**********************************************************************
+ * Sends a client as much of its queued replies as it will take. While
+ * replies are left over, the client is polled for writing, and one
+ * that has left CLIENT_OUT_LIMIT bytes unread is not read from until
+ * it catches up, so it cannot make the manager buffer without end.
+ *
+ * Params:	c:	The client
+ *********************************************************************/
+void writeClient(struct client *c){
+	while(c->outSent < c->outLen){
+		ssize_t n = send(c->fd, c->out + c->outSent, c->outLen - c->outSent, MSG_NOSIGNAL);
+		if(n < 0 && errno == EINTR){
+			continue;
+		}
+		if(n < 0 && errno == EAGAIN){
+			break;
+		}
+		if(n <= 0){
+			closeClient(c);
+			return;
+		}
+		c->outSent += n;
+	}
+	if(c->outSent == c->outLen){
+		c->outSent = c->outLen = 0;
+		if(c->closing){
+			closeClient(c);
+			return;
+		}
+	}
+	struct epoll_event ev;
+	ev.events = c->outLen == 0 ? EPOLLIN : c->outLen - c->outSent > CLIENT_OUT_LIMIT || c->closing
+			? EPOLLOUT : EPOLLIN | EPOLLOUT;
+	ev.data.ptr = &c->source;
+	epoll_ctl(epollFd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+
+/**********************************************************************
+ * Hangs up on a client
+ *
+ * Params:	c:	The client
+ *********************************************************************/
+void closeClient(struct client *c){
+	close(c->fd);
+	if(c->prev != NULL){
+		c->prev->next = c->next;
+	}
+	else{
+		clients = c->next;
+	}
+	if(c->next != NULL){
+		c->next->prev = c->prev;
+	}
+	free(c->out);
+	free(c);
+}
+
+
+/**********************************************************************
+ * Points stdout and stderr back at the manager's own streams after a
+ * client's command, and in any child forked while one was running
+ *********************************************************************/
+void restoreConsole(){
+	stdout = console;
+	stderr = consoleErr;
+}
+
+
+/**********************************************************************
+ * Starts, or restarts, the watch feed. Every tick writes one JSON line
+ * per server that changed since the last tick:
+ * 	{"ts":MS,"event":"added","server":NAME,"pid":...,"min":...,
+ * 	 "max":...,"backend":...,"workers":...,"spares":...}
+ * 	{"ts":MS,"event":"changed","server":NAME, only the fields that
+ * 	 changed among pid, workers, spares, queued, running, submitted
+ * 	 and done}
+ * followed by one line per worker it reaped since, timed when it was
+ * reaped, where lost is true for a worker that was still active
+ * rather than a spare or retired:
+ * 	{"ts":MS,"event":"workerexited","server":NAME,"pid":...,
+ * 	 "lost":BOOL,"code":N or "signal":N}
+ * Only the last WORKER_EXITS of these are kept between ticks; the
+ * first line after a gap says how many were missed in "missed":N.
+ * A server's exit is written as soon as it is reaped:
+ * 	{"ts":MS,"event":"exited","server":NAME,"pid":...,"aborted":BOOL,
+ * 	 "code":N or "signal":N, neither for an adopted server}
+ * ts is wall-clock milliseconds. A new watch reports every server as
+ * added again, so a consumer can start from the first line it reads.
+ *
+ * Params:	interval:	Milliseconds between ticks
+ * 			file:		Where to append the feed, NULL for stdout
+ * Returns:	false if the file or timer could not be opened
+ *********************************************************************/
+bool startWatch(int interval, const char *file){
+	FILE *out = console;
+	if(file != NULL && (out = fopen(file, "ae")) == NULL){
+		perror(file);
+		return false;
+	}
+	stopWatch();
+	struct itimerspec spec;
+	spec.it_interval.tv_sec = interval / 1000;
+	spec.it_interval.tv_nsec = (interval % 1000) * 1000000L;
+	spec.it_value = spec.it_interval;
+	if((watchTimer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0
+			|| timerfd_settime(watchTimer, 0, &spec, NULL) < 0 || !watchFd(watchTimer, &watchSource)){
+		perror("timerfd");
+		if(watchTimer >= 0){
+			close(watchTimer);
+			watchTimer = -1;
+		}
+		if(out != console){
+			fclose(out);
+		}
+		return false;
+	}
+	watchOut = out;
+	int i;
+	for(i = 0; i < servers.size; i++){
+		struct server *s = servers.slots[i];
+		if(s && s != &tombstone){
+			s->watchSeen = false;
+		}
+	}
+	watchTick();
+	return true;
+}
+
+
+/**********************************************************************
+ * Stops the watch feed, if one is running
+ *********************************************************************/
+void stopWatch(){
+	if(watchTimer >= 0){
+		close(watchTimer);
+		watchTimer = -1;
+	}
+	if(watchOut != NULL){
+		if(watchOut != console){
+			fclose(watchOut);
+		}
+		else{
+			fflush(console);
+		}
+		watchOut = NULL;
+	}
+}
+
+
+/**********************************************************************
+ * Writes one round of the watch feed from the status table. A server
+ * that has not yet published its first update is left for a later
+ * tick, so its added line has real counts.
+ *********************************************************************/
+void watchTick(){
+	//watch off may have run earlier in the same round
+	if(watchTimer < 0){
+		return;
+	}
+	unsigned long long expirations;
+	if(read(watchTimer, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN){
+		perror("read");
+	}
+	unsigned long long ts = wallMillis();
+	int i;
+	for(i = 0; i < servers.size; i++){
+		struct server *s = servers.slots[i];
+		if(s == NULL || s == &tombstone){
+			continue;
+		}
+		struct serverSlot slot;
+		if(!seqRead(&slot, &status->servers[s->slot], sizeof(slot)) || slot.pid == 0){
+			continue;
+		}
+		unsigned int missed = 0;
+		struct watchSnapshot now = {slot.pid, slot.numWorkers, slot.numSpares, slot.queued, slot.running,
+			slot.submitted, slot.done};
+		struct watchSnapshot *last = &s->watched;
+		if(!s->watchSeen){
+			fprintf(watchOut, "{\"ts\":%llu,\"event\":\"added\",\"server\":", ts);
+			jsonString(watchOut, s->name);
+			fprintf(watchOut, ",\"pid\":%d,\"min\":%d,\"max\":%d,\"backend\":\"%s\",\"workers\":%d,\"spares\":%d}\n",
+					now.pid, slot.minProcs, slot.maxProcs, s->config.backend->name, now.numWorkers, now.numSpares);
+		}
+		else if(memcmp(&now, last, sizeof(now)) != 0){
+			fprintf(watchOut, "{\"ts\":%llu,\"event\":\"changed\",\"server\":", ts);
+			jsonString(watchOut, s->name);
+			if(now.pid != last->pid){
+				fprintf(watchOut, ",\"pid\":%d", now.pid);
+			}
+			if(now.numWorkers != last->numWorkers){
+				fprintf(watchOut, ",\"workers\":%d", now.numWorkers);
+			}
+			if(now.numSpares != last->numSpares){
+				fprintf(watchOut, ",\"spares\":%d", now.numSpares);
+			}
+			if(now.queued != last->queued){
+				fprintf(watchOut, ",\"queued\":%d", now.queued);
+			}
+			if(now.running != last->running){
+				fprintf(watchOut, ",\"running\":%d", now.running);
+			}
+			if(now.submitted != last->submitted){
+				fprintf(watchOut, ",\"submitted\":%llu", now.submitted);
+			}
+			if(now.done != last->done){
+				fprintf(watchOut, ",\"done\":%llu", now.done);
+			}
+			fprintf(watchOut, "}\n");
+		}
+		if(!s->watchSeen){
+			s->exitsSeen = slot.numExits;
+		}
+		if(slot.numExits - s->exitsSeen > WORKER_EXITS){
+			missed = slot.numExits - s->exitsSeen - WORKER_EXITS;
+			s->exitsSeen = slot.numExits - WORKER_EXITS;
+		}
+		for(; s->exitsSeen != slot.numExits; s->exitsSeen++){
+			struct workerExit *e = &slot.exits[s->exitsSeen % WORKER_EXITS];
+			fprintf(watchOut, "{\"ts\":%llu,\"event\":\"workerexited\",\"server\":", e->time);
+			jsonString(watchOut, s->name);
+			fprintf(watchOut, ",\"pid\":%d,\"lost\":%s", e->pid, e->lost ? "true" : "false");
+			if(WIFSIGNALED(e->status)){
+				fprintf(watchOut, ",\"signal\":%d", WTERMSIG(e->status));
+			}
+			else{
+				fprintf(watchOut, ",\"code\":%d", WEXITSTATUS(e->status));
+			}
+			if(missed > 0){
+				fprintf(watchOut, ",\"missed\":%u", missed);
+				missed = 0;
+			}
+			fprintf(watchOut, "}\n");
+		}
+		*last = now;
+		s->watchSeen = true;
+	}
+	fflush(watchOut);
+}
+
+
+/**********************************************************************
+ * Writes a server's exit to the watch feed as soon as it is reaped
+ *
+ * Params:	s:		The server that exited
+ * 			status:	Its wait status, unknown for an adopted server
+ *********************************************************************/
+void watchExit(struct server *s, int status){
+	fprintf(watchOut, "{\"ts\":%llu,\"event\":\"exited\",\"server\":", wallMillis());
+	jsonString(watchOut, s->name);
+	fprintf(watchOut, ",\"pid\":%d,\"aborted\":%s", s->pid, s->dying ? "true" : "false");
+	if(!s->adopted){
+		if(WIFSIGNALED(status)){
+			fprintf(watchOut, ",\"signal\":%d", WTERMSIG(status));
+		}
+		else{
+			fprintf(watchOut, ",\"code\":%d", WEXITSTATUS(status));
+		}
+	}
+	fprintf(watchOut, "}\n");
+	fflush(watchOut);
+}
+
+
+/**********************************************************************
+ * Writes a string as a quoted JSON string
+ *
+ * Params:	out:	Where to write it
+ * 			str:	The string
+ *********************************************************************/
+void jsonString(FILE *out, const char *str){
+	putc('"', out);
+	for(; *str; str++){
+		unsigned char c = *str;
+		if(c == '"' || c == '\\'){
+			putc('\\', out);
+			putc(c, out);
+		}
+		else if(c < 0x20){
+			fprintf(out, "\\u%04x", c);
+		}
+		else{
+			putc(c, out);
+		}
+	}
+	putc('"', out);
+}
+
+
+/**********************************************************************
+ * Returns the wall-clock time in milliseconds since the epoch
+ *********************************************************************/
+unsigned long long wallMillis(){
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (unsigned long long)ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+
+/**********************************************************************
+ * Closes every descriptor a new child inherited except stdio
+ *
+ * Params:	keep:	One descriptor to leave open, -1 for none
+ *********************************************************************/
+void closeInheritedFds(int keep){
+	if(keep < 0){
+		if(syscall(SYS_close_range, 3, ~0U, 0) == 0){
+			return;
+		}
+	}
+	else if((keep == 3 || syscall(SYS_close_range, 3, keep - 1, 0) == 0)
+			&& syscall(SYS_close_range, keep + 1, ~0U, 0) == 0){
+		return;
+	}
+	int fd, maxFd = sysconf(_SC_OPEN_MAX);
+	for(fd = 3; fd < maxFd; fd++){
+		if(fd != keep){
+			close(fd);
+		}
+	}
+}
+
+
+/**********************************************************************
+ * Starts the server's periodic tick
+ *
+ * Params:	interval:	Milliseconds between ticks
+ * Returns:	false if the timer could not be made
+ *********************************************************************/
+bool startTimer(int interval){
+	struct itimerspec spec;
+	spec.it_interval.tv_sec = interval / 1000;
+	spec.it_interval.tv_nsec = (interval % 1000) * 1000000L;
+	spec.it_value = spec.it_interval;
+	if((self->timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0
+			|| timerfd_settime(self->timerFd, 0, &spec, NULL) < 0){
+		perror("timerfd");
+		return false;
+	}
+	return watchFd(self->timerFd, &timerSource);
+}
+
+
+/**********************************************************************
+ * Runs the server's periodic work when its timer fires
+ *********************************************************************/
+void serverTick(){
+	unsigned long long expirations;
+	if(read(self->timerFd, &expirations, sizeof(expirations)) != sizeof(expirations)){
+		return;
+	}
+	sampleUsage();
+	wakeOrphans();
+	if(self->config.heartbeat > 0){
+		checkHeartbeats();
+	}
+	checkDrains();
+	if(self->config.autoscale != SCALE_NONE){
+		autoscale();
+	}
+}
+
+
+/**********************************************************************
+ * Replaces every active worker whose heartbeat has not moved for the
+ * server's heartbeat timeout. Beats are counted from when the worker
+ * started or was promoted, since a parked spare does not beat.
+ *********************************************************************/
+void checkHeartbeats(){
+	unsigned long long now = nowNanos();
+	unsigned long long limit = self->config.heartbeat * 1000000ULL;
+	struct worker *w, *next;
+	for(w = self->workers; w; w = next){
+		next = w->next;
+		if(w->slot < 0){
+			continue;
+		}
+		unsigned long long beats = __atomic_load_n(&status->workers[w->slot].beats, __ATOMIC_RELAXED);
+		if(beats != w->lastBeat){
+			w->lastBeat = beats;
+			w->beatAt = now;
+		}
+		else if(now - w->beatAt > limit){
+			printf("%s: worker %d missed heartbeats for %llu ms, replacing it\n",
+					self->name, w->pid, (now - w->beatAt) / 1000000);
+			replaceWorker(w);
+		}
+	}
+	fflush(stdout);
+}
+
+
+/**********************************************************************
+ * Kills a hung worker and starts another in its place. A hung thread
+ * cannot be killed, so it is only asked to stop and waits on the
+ * retiring list in case it ever wakes.
+ *
+ * Params:	w:	The active worker to replace
+ *********************************************************************/
+void replaceWorker(struct worker *w){
+	w->killedAt = nowNanos();
+	if(self->config.backend->threads){
+		self->config.backend->stop(w);
+	}
+	else{
+		kill(w->pid, SIGKILL);
+		w->forced = true;
+	}
+	retireWorker(w);
+	self->replaced++;
+	createProcess();
+}
+
+
+/**********************************************************************
+ * Grows or shrinks the server from its latest load sample. The gap
+ * between scaleup and scaledown gives hysteresis, and after any step
+ * the server holds still for the cooldown. Growth is proportional to
+ * how far the load is over the threshold; shrinking is one worker at
+ * a time.
+ *********************************************************************/
+void autoscale(){
+	double load;
+	if(!sampleLoad(&load)){
+		return;
+	}
+	self->load = load;
+	unsigned long long now = nowNanos();
+	if(self->lastScale != 0 && now - self->lastScale < self->config.cooldown * 1000000000ULL){
+		return;
+	}
+
+	if(load > self->config.scaleUp && self->numWorkers < self->config.maxProcs){
+		double need = self->numWorkers * load / self->config.scaleUp;
+		int want = (int)need < need ? (int)need + 1 : (int)need;
+		if(want <= self->numWorkers){
+			want = self->numWorkers + 1;
+		}
+		if(want > self->config.maxProcs){
+			want = self->config.maxProcs;
+		}
+		printf("%s: load %.2f, scaling up to %d workers\n", self->name, load, want);
+		while(self->numWorkers < want){
+			int before = self->numWorkers;
+			createProcess();
+			if(self->numWorkers == before){
+				break;
+			}
+		}
+		self->lastScale = now;
+	}
+	else if(load < self->config.scaleDown && self->numWorkers > self->config.minProcs){
+		printf("%s: load %.2f, scaling down to %d workers\n", self->name, load, self->numWorkers - 1);
+		abortProcess();
+		self->lastScale = now;
+	}
+	fflush(stdout);
+}
+
+
+/**********************************************************************
+ * Samples the server's load signal
+ *
+ * Params:	load:	Where the per-worker load is stored
+ * Returns:	false if there is no sample yet
+ *********************************************************************/
+bool sampleLoad(double *load){
+	if(self->config.autoscale == SCALE_QUEUE){
+		int queued, running;
+		unsigned long long done, stolen;
+		countTasks(&queued, &running, &done, &stolen);
+		*load = (queued + running) / (double)(self->numWorkers ? self->numWorkers : 1);
+		return true;
+	}
+	if(self->config.autoscale == SCALE_FILE){
+		FILE *f = fopen(self->config.loadFile, "r");
+		double total;
+		if(f == NULL){
+			return false;
+		}
+		int n = fscanf(f, "%lf", &total);
+		fclose(f);
+		if(n != 1){
+			return false;
+		}
+		*load = total / (self->numWorkers ? self->numWorkers : 1);
+		return true;
+	}
+
+	//cpu: ticks used by every active worker since the last sample
+	unsigned long long now = nowNanos();
+	unsigned long long used = 0;
+	struct worker *w;
+	for(w = self->workers; w; w = w->next){
+		unsigned long long ticks;
+		char dir[64];
+		workerProcDir(w, dir, sizeof(dir));
+		if(readCpuTicks(dir, &ticks)){
+			if(w->cpuSampled){
+				used += ticks - w->cpuTicks;
+			}
+			w->cpuTicks = ticks;
+			w->cpuSampled = true;
+		}
+	}
+	unsigned long long last = self->lastSample;
+	self->lastSample = now;
+	if(last == 0 || self->numWorkers == 0){
+		return false;
+	}
+	double seconds = (now - last) / 1e9;
+	*load = used / (double)sysconf(_SC_CLK_TCK) / seconds / self->numWorkers;
+	return true;
+}
+
+
+/**********************************************************************
+ * Reads the user plus system CPU time of a process or thread
+ *
+ * Params:	dir:	Its directory under /proc
+ * 			ticks:	Where the time is stored, in clock ticks
+ * Returns:	false if <dir>/stat could not be read
+ *********************************************************************/
+bool readCpuTicks(const char *dir, unsigned long long *ticks){
+	char path[96], buf[1024];
+	snprintf(path, sizeof(path), "%s/stat", dir);
+	FILE *f = fopen(path, "r");
+	if(f == NULL){
+		return false;
+	}
+	size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+	fclose(f);
+	buf[n] = '\0';
+
+	//skip past the command name, which may itself hold spaces
+	char *p = strrchr(buf, ')');
+	unsigned long long utime, stime;
+	if(p == NULL || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", &utime, &stime) != 2){
+		return false;
+	}
+	*ticks = utime + stime;
+	return true;
+}
+
+
+/**********************************************************************
+ * Refreshes the resource usage of every live worker from /proc and
+ * recomputes the server's total. Spares are left out until they are
+ * promoted; their usage is counted once they are reaped.
+ *********************************************************************/
+void sampleUsage(){
+	self->usage = self->reaped;
+	struct worker *w;
+	for(w = self->workers; w; w = w->next){
+		char dir[64];
+		workerProcDir(w, dir, sizeof(dir));
+		if(readUsage(dir, &w->usage)){
+			publishWorker(w);
+		}
+		addUsage(&self->usage, &w->usage);
+	}
+}
+
+
+/**********************************************************************
+ * Reads the resource usage of a live process or thread
+ *
+ * Params:	dir:	Its directory under /proc
+ * 			u:		Where the usage is stored
+ * Returns:	false if dir could not be read
+ *********************************************************************/
+bool readUsage(const char *dir, struct usage *u){
+	char path[96], buf[1024];
+	snprintf(path, sizeof(path), "%s/stat", dir);
+	FILE *f = fopen(path, "r");
+	if(f == NULL){
+		return false;
+	}
+	size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+	fclose(f);
+	buf[n] = '\0';
+
+	char *p = strrchr(buf, ')');
+	unsigned long long minFaults, majFaults, utime, stime;
+	if(p == NULL || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %llu %*u %llu %*u %llu %llu",
+			&minFaults, &majFaults, &utime, &stime) != 4){
+		return false;
+	}
+	long hz = sysconf(_SC_CLK_TCK);
+	u->userUsec = utime * 1000000ULL / hz;
+	u->sysUsec = stime * 1000000ULL / hz;
+	u->minFaults = minFaults;
+	u->majFaults = majFaults;
+
+	//peak RSS and context switches are only in the status file
+	snprintf(path, sizeof(path), "%s/status", dir);
+	if((f = fopen(path, "r")) == NULL){
+		return false;
+	}
+	char line[256];
+	while(fgets(line, sizeof(line), f) != NULL){
+		if(sscanf(line, "VmHWM: %ld", &u->maxRss) != 1
+				&& sscanf(line, "voluntary_ctxt_switches: %ld", &u->volSwitches) != 1){
+			sscanf(line, "nonvoluntary_ctxt_switches: %ld", &u->involSwitches);
+		}
+	}
+	fclose(f);
+	return true;
+}
+
+
+/**********************************************************************
+ * Adds one worker's usage to a total
+ *
+ * Params:	total:	The running total
+ * 			u:		The usage to add
+ *********************************************************************/
+void addUsage(struct usage *total, const struct usage *u){
+	total->userUsec += u->userUsec;
+	total->sysUsec += u->sysUsec;
+	if(u->maxRss > total->maxRss){
+		total->maxRss = u->maxRss;
+	}
+	total->minFaults += u->minFaults;
+	total->majFaults += u->majFaults;
+	total->volSwitches += u->volSwitches;
+	total->involSwitches += u->involSwitches;
+}
+
+
+/**********************************************************************
+ * Adds a reaped worker's rusage to a total
+ *
+ * Params:	total:	The running total
+ * 			ru:		The rusage returned by wait4
+ *********************************************************************/
+void addRusage(struct usage *total, const struct rusage *ru){
+	struct usage u;
+	u.userUsec = ru->ru_utime.tv_sec * 1000000ULL + ru->ru_utime.tv_usec;
+	u.sysUsec = ru->ru_stime.tv_sec * 1000000ULL + ru->ru_stime.tv_usec;
+	u.maxRss = ru->ru_maxrss;
+	u.minFaults = ru->ru_minflt;
+	u.majFaults = ru->ru_majflt;
+	u.volSwitches = ru->ru_nvcsw;
+	u.involSwitches = ru->ru_nivcsw;
+	addUsage(total, &u);
+}
+
+
+/**********************************************************************
+ * Creates and maps the shared status table
+ *
+ * Returns:	false if the segment could not be created
+ *********************************************************************/
+bool createStatusTable(){
+	snprintf(statusName, sizeof(statusName), "/processManager.%d", getpid());
+	int fd = shm_open(statusName, O_CREAT | O_EXCL | O_RDWR | O_CLOEXEC, 0644);
+	if(fd < 0){
+		perror("shm_open");
+		return false;
+	}
+	size_t size = sizeof(struct statusTable) + SLAB_CHUNK * sizeof(struct serverSlot);
+	if(ftruncate(fd, size) < 0){
+		perror("ftruncate");
+		close(fd);
+		shm_unlink(statusName);
+		return false;
+	}
+	status = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if(status == MAP_FAILED){
+		perror("mmap");
+		close(fd);
+		shm_unlink(statusName);
+		return false;
+	}
+	statusFd = fd;
+	status->header.numServerSlots = SLAB_CHUNK;
+	status->header.numWorkerSlots = MAX_WORKER_SLOTS;
+	status->header.managerPid = getpid();
+	__atomic_store_n(&status->header.magic, STATUS_MAGIC, __ATOMIC_RELEASE);
+	return true;
+}
+
+
+/**********************************************************************
+ * Makes room in the status table for at least the given number of
+ * server slots, doubling it as needed. The mapping may move, but only
+ * the manager follows it; each server keeps the mapping it was forked
+ * with, which already holds its own slot.
+ *
+ * Params:	numSlots:	The number of server slots needed
+ * Returns:	false if the segment could not be grown
+ *********************************************************************/
+bool growStatusTable(unsigned int numSlots){
+	unsigned int oldSlots = status->header.numServerSlots;
+	if(numSlots <= oldSlots){
+		return true;
+	}
+	unsigned int newSlots = oldSlots;
+	while(newSlots < numSlots){
+		newSlots *= 2;
+	}
+	size_t oldSize = sizeof(struct statusTable) + oldSlots * sizeof(struct serverSlot);
+	size_t newSize = sizeof(struct statusTable) + newSlots * sizeof(struct serverSlot);
+	if(ftruncate(statusFd, newSize) < 0){
+		perror("ftruncate");
+		return false;
+	}
+	void *table = mremap(status, oldSize, newSize, MREMAP_MAYMOVE);
+	if(table == MAP_FAILED){
+		perror("mremap");
+		return false;
+	}
+	status = (struct statusTable *)table;
+	__atomic_store_n(&status->header.numServerSlots, newSlots, __ATOMIC_RELEASE);
+	return true;
+}
+
+
+/**********************************************************************
+ * Removes the shared status table's name when the manager exits
+ *********************************************************************/
+void removeStatusTable(){
+	if(statusName[0] != '\0'){
+		shm_unlink(statusName);
+	}
+}
+
+
+/**********************************************************************
+ * Opens a slot for writing by making its sequence counter odd. A
+ * writer killed in the middle of an update leaves it odd; the next
+ * write, which is at the latest when the slot is released or claimed
+ * again, makes it even once more instead of keeping the parity.
+ *
+ * Params:	seq:	The slot's sequence counter
  *********************************************************************/
-void displayStatus(){
-	printf("Original servers running: %d\n", numActive);
-	printf("\n");
+void seqBegin(unsigned int *seq){
+	__atomic_store_n(seq, *seq | 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+
+/**********************************************************************
+ * Closes a slot after writing by making its sequence counter even
+ *
+ * Params:	seq:	The slot's sequence counter
+ *********************************************************************/
+void seqEnd(unsigned int *seq){
+	__atomic_store_n(seq, *seq + 1, __ATOMIC_RELEASE);
+}
+
+
+/**********************************************************************
+ * Copies a consistent snapshot of a slot. A slot whose writer died in
+ * the middle of an update stays odd, so the reader gives up after
+ * SEQ_RETRIES tries rather than spin on it for ever.
+ *
+ * Params:	dst:	Where the copy goes
+ * 			slot:	The slot, starting with its sequence counter
+ * 			len:	The size of the slot
+ * Returns:	false if the slot is torn; dst then holds the last copy
+ *********************************************************************/
+bool seqRead(void *dst, const void *slot, size_t len){
+	const unsigned int *seq = (const unsigned int *)slot;
+	unsigned int before, after;
+	int tries;
+	for(tries = 0; tries < SEQ_RETRIES; tries++){
+		before = __atomic_load_n(seq, __ATOMIC_ACQUIRE);
+		if(before & 1){
+			sched_yield();
+			continue;
+		}
+		memcpy(dst, slot, len);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		after = __atomic_load_n(seq, __ATOMIC_RELAXED);
+		if(before == after){
+			return true;
+		}
+	}
+	memcpy(dst, slot, len);
+	return false;
+}
+
+
+/**********************************************************************
+ * Writes the current server's counters to its status slot
+ *********************************************************************/
+void publishServer(){
+	struct serverSlot *slot = &status->servers[self->slot];
+	seqBegin(&slot->seq);
+	slot->pid = self->pid;
+	slot->numWorkers = self->numWorkers;
+	slot->numSpares = self->numSpares;
+	slot->poolHits = self->poolHits;
+	slot->poolMisses = self->poolMisses;
+	slot->load = self->load;
+	slot->usage = self->usage;
+	slot->submitted = self->submitted;
+	slot->targets = self->numTargets;
+	slot->replaced = self->replaced;
+	slot->queuedStarts = self->queuedStarts;
+	if(slot->numExits != self->numExits){
+		slot->numExits = self->numExits;
+		memcpy(slot->exits, self->exits, sizeof(slot->exits));
+	}
+	countTasks(&slot->queued, &slot->running, &slot->done, &slot->stolen);
+	seqEnd(&slot->seq);
+}
+
+
+/**********************************************************************
+ * Writes a worker's pid and state to its status slot
+ *
+ * Params:	w:	The worker to publish
+ *********************************************************************/
+void publishWorker(struct worker *w){
+	if(w->slot < 0){
+		return;
+	}
+	struct workerSlot *slot = &status->workers[w->slot];
+	seqBegin(&slot->seq);
+	slot->pid = w->pid;
+	slot->state = w->state;
+	slot->inflight = dequeInflight(w->deque);
+	slot->usage = w->usage;
+	seqEnd(&slot->seq);
+}
+
+
+/**********************************************************************
+ * Claims a free worker slot for the current server. The search starts
+ * where the last one ended, so it is usually a single probe. The slot
+ * joins the server's list of owned slots, which the manager walks to
+ * clear them if the server dies before releasing them.
+ *
+ * Returns:	The slot number, or -1 if the table is full
+ *********************************************************************/
+int claimWorkerSlot(){
+	int i;
+	for(i = 0; i < MAX_WORKER_SLOTS; i++){
+		int n = (workerSlotHint + i) % MAX_WORKER_SLOTS;
+		int expected = 0;
+		if(__atomic_compare_exchange_n(&status->workers[n].owner, &expected, self->slot + 1,
+				false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)){
+			struct workerSlot *w = &status->workers[n];
+			int *first = &status->servers[self->slot].firstOwned;
+			__atomic_store_n(&w->busy, 0, __ATOMIC_RELAXED);
+			w->prevOwned = 0;
+			w->nextOwned = *first;
+			if(*first != 0){
+				status->workers[*first - 1].prevOwned = n + 1;
+			}
+			__atomic_store_n(first, n + 1, __ATOMIC_RELEASE);
+			workerSlotHint = n + 1;
+			return n;
+		}
+	}
+	return -1;
+}
+
+
+/**********************************************************************
+ * Clears a reaped worker's slot and gives it back
+ *
+ * Params:	w:	The worker whose slot is released
+ *********************************************************************/
+void releaseWorkerSlot(struct worker *w){
+	if(w->slot < 0){
+		return;
+	}
+	struct workerSlot *slot = &status->workers[w->slot];
+	seqBegin(&slot->seq);
+	slot->pid = 0;
+	slot->state = 0;
+	memset(&slot->usage, 0, sizeof(slot->usage));
+	seqEnd(&slot->seq);
+	if(slot->prevOwned != 0){
+		status->workers[slot->prevOwned - 1].nextOwned = slot->nextOwned;
+	}
+	else{
+		__atomic_store_n(&status->servers[self->slot].firstOwned, slot->nextOwned, __ATOMIC_RELEASE);
+	}
+	if(slot->nextOwned != 0){
+		status->workers[slot->nextOwned - 1].prevOwned = slot->prevOwned;
+	}
+	__atomic_store_n(&slot->owner, 0, __ATOMIC_RELEASE);
+	w->slot = -1;
+}
+
+
+/**********************************************************************
+ * Clears a reaped server's slot, along with any worker slots the
+ * server did not get to release itself, found through its list of
+ * owned slots so the cost follows its own workers and not the table.
+ * The slot is reused along with the server's record once
+ * freeServer() hands it back.
+ *
+ * Params:	s:	The server whose slot is released
+ *********************************************************************/
+void releaseServerSlot(struct server *s){
+	struct serverSlot *slot = &status->servers[s->slot];
+	seqBegin(&slot->seq);
+	slot->inUse = 0;
+	slot->pid = 0;
+	memset(&slot->usage, 0, sizeof(slot->usage));
+	seqEnd(&slot->seq);
+
+	//a server killed in the middle of linking a slot leaves the list
+	//cut short, never looping, but it is still walked warily
+	int n = __atomic_exchange_n(&slot->firstOwned, 0, __ATOMIC_ACQUIRE);
+	int steps;
+	for(steps = 0; n > 0 && n <= MAX_WORKER_SLOTS && steps < MAX_WORKER_SLOTS; steps++){
+		struct workerSlot *w = &status->workers[n - 1];
+		if(__atomic_load_n(&w->owner, __ATOMIC_RELAXED) != s->slot + 1){
+			break;
+		}
+		n = w->nextOwned;
+		seqBegin(&w->seq);
+		w->pid = 0;
+		w->state = 0;
+		memset(&w->usage, 0, sizeof(w->usage));
+		seqEnd(&w->seq);
+		w->prevOwned = w->nextOwned = 0;
+		__atomic_store_n(&w->owner, 0, __ATOMIC_RELEASE);
+	}
+}
+
+
+/**********************************************************************
+ * Adds one latency to a histogram
+ *
+ * Params:	id:		Which histogram, a command index or a statId
+ * 			nanos:	The latency in nanoseconds
+ *********************************************************************/
+void recordStat(int id, unsigned long long nanos){
+	struct histogram *h = &stats[id];
+	if(h->count == 0 || nanos < h->min){
+		h->min = nanos;
+	}
+	if(nanos > h->max){
+		h->max = nanos;
+	}
+	h->count++;
+	h->sum += nanos;
+	h->buckets[histBucket(nanos)]++;
+}
+
+
+/**********************************************************************
+ * Finds the bucket a value falls in. Values below 2^HIST_SUB_BITS get
+ * a bucket each; above that the top HIST_SUB_BITS bits after the
+ * leading one pick the bucket within its power of two.
+ *
+ * Params:	value:	The value in nanoseconds
+ * Returns:	The bucket index
+ *********************************************************************/
+int histBucket(unsigned long long value){
+	if(value < (1ULL << HIST_SUB_BITS)){
+		return (int)value;
+	}
+	int exponent = 63 - __builtin_clzll(value);
+	if(exponent >= HIST_MAX_BITS){
+		return HIST_BUCKETS - 1;
+	}
+	int sub = (int)(value >> (exponent - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1);
+	return ((exponent - HIST_SUB_BITS + 1) << HIST_SUB_BITS) + sub;
+}
+
+
+/**********************************************************************
+ * Returns the value in the middle of a bucket
+ *
+ * Params:	bucket:	The bucket index
+ *********************************************************************/
+unsigned long long bucketValue(int bucket){
+	if(bucket < (1 << HIST_SUB_BITS)){
+		return bucket;
+	}
+	int exponent = (bucket >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+	int sub = bucket & ((1 << HIST_SUB_BITS) - 1);
+	unsigned long long width = 1ULL << (exponent - HIST_SUB_BITS);
+	return (1ULL << exponent) + sub * width + width / 2;
+}
+
+
+/**********************************************************************
+ * Finds a percentile of a histogram by the nearest-rank method
+ *
+ * Params:	h:			The histogram
+ * 			permille:	The percentile in tenths of a percent
+ * Returns:	The percentile in nanoseconds, clamped to the recorded
+ * 			minimum and maximum
+ *********************************************************************/
+unsigned long long histPercentile(const struct histogram *h, int permille){
+	unsigned long long rank = (h->count * permille + 999) / 1000;
+	unsigned long long seen = 0;
+	int i;
+	for(i = 0; i < HIST_BUCKETS; i++){
+		seen += h->buckets[i];
+		if(seen >= rank && seen > 0){
+			unsigned long long value = bucketValue(i);
+			return value < h->min ? h->min : value > h->max ? h->max : value;
+		}
+	}
+	return h->max;
+}
+
+
+/**********************************************************************
+ * Prints every histogram of the current process that has samples
+ *********************************************************************/
+void printStats(){
+	int i;
+	for(i = 0; i < NUM_STATS; i++){
+		const struct histogram *h = &stats[i];
+		if(h->count == 0){
+			continue;
+		}
+		printf("  %-15s n=%-7llu min %9.1f  p50 %9.1f  p99 %9.1f  p999 %9.1f  max %9.1f  mean %9.1f us\n",
+				statNames[i], h->count, h->min / 1e3, histPercentile(h, 500) / 1e3,
+				histPercentile(h, 990) / 1e3, histPercentile(h, 999) / 1e3, h->max / 1e3,
+				h->sum / (double)h->count / 1e3);
+	}
+}
+
+
+/**********************************************************************
+ * Clears every histogram of the current process
+ *********************************************************************/
+void resetStats(){
+	memset(stats, 0, sizeof(stats));
+}
+
+
+/**********************************************************************
+ * Creates the current server's task pool
+ *
+ * Returns:	false if the pool could not be created
+ *********************************************************************/
+bool createTaskPool(){
+	//not close-on-exec: spawn workers inherit it
+	taskFd = memfd_create("processManager.tasks", 0);
+	if(taskFd < 0){
+		perror("memfd_create");
+		return false;
+	}
+	if(ftruncate(taskFd, sizeof(struct taskPool)) < 0){
+		perror("ftruncate");
+		return false;
+	}
+	if(!mapTaskPool(taskFd)){
+		return false;
+	}
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	int i;
+	for(i = 0; i < TASK_DEQUES; i++){
+		pthread_mutex_init(&taskPool->deques[i].lock, &attr);
+	}
+	pthread_mutexattr_destroy(&attr);
+	if(sem_init(&taskPool->pending, 1, 0) < 0){
+		perror("sem_init");
+		return false;
+	}
+	return true;
+}
+
+
+/**********************************************************************
+ * Maps a task pool
+ *
+ * Params:	fd:		The pool's memfd
+ * Returns:	false if it could not be mapped
+ *********************************************************************/
+bool mapTaskPool(int fd){
+	void *pool = mmap(NULL, sizeof(struct taskPool), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if(pool == MAP_FAILED){
+		perror("mmap");
+		return false;
+	}
+	taskPool = (struct taskPool *)pool;
+	return true;
+}
+
+
+/**********************************************************************
+ * Picks a home deque for a new worker, the one with fewest workers
+ *
+ * Returns:	The deque index
+ *********************************************************************/
+int claimDeque(){
+	int i, best = 0;
+	for(i = 1; i < TASK_DEQUES && self->dequeUsers[best] > 0; i++){
+		if(self->dequeUsers[i] < self->dequeUsers[best]){
+			best = i;
+		}
+	}
+	self->dequeUsers[best]++;
+	return best;
+}
+
+
+/**********************************************************************
+ * Queues tasks for the current server's workers, round-robin over
+ * the deques that have a worker. Tasks that find every deque full
+ * are dropped and counted.
+ *
+ * Params:	count:		How many tasks to queue
+ * 			costUsec:	How long each one keeps a worker busy
+ *********************************************************************/
+void submitTasks(int count, int costUsec){
+	struct task t;
+	t.submitted = nowNanos();
+	t.costUsec = costUsec;
+	int i, rejected = 0;
+	for(i = 0; i < count; i++){
+		int tries;
+		bool queued = false;
+		for(tries = 0; tries < TASK_DEQUES && !queued; tries++){
+			int d = self->nextDeque;
+			self->nextDeque = (self->nextDeque + 1) % TASK_DEQUES;
+			if(self->dequeUsers[d] > 0 || (self->numWorkers == 0 && self->numSpares == 0)){
+				queued = pushTask(&taskPool->deques[d], &t);
+			}
+		}
+		if(!queued){
+			rejected++;
+			continue;
+		}
+		sem_post(&taskPool->pending);
+	}
+	self->submitted += count - rejected;
+	self->rejected += rejected;
+	if(rejected > 0){
+		printf("%s: %d tasks rejected, queues full\n", self->name, rejected);
+		fflush(stdout);
+	}
+}
+
+
+/**********************************************************************
+ * Pushes a task onto the home end of a deque
+ *
+ * Params:	d:	The deque
+ * 			t:	The task
+ * Returns:	false if the deque is full
+ *********************************************************************/
+bool pushTask(struct taskDeque *d, const struct task *t){
+	bool pushed = false;
+	pthread_mutex_lock(&d->lock);
+	if(d->bottom - d->top < TASK_DEQUE_SIZE){
+		d->tasks[d->bottom % TASK_DEQUE_SIZE] = *t;
+		__atomic_store_n(&d->bottom, d->bottom + 1, __ATOMIC_RELEASE);
+		pushed = true;
+	}
+	pthread_mutex_unlock(&d->lock);
+	return pushed;
+}
+
+
+/**********************************************************************
+ * Takes a task for a worker: the newest one on its home deque, or
+ * else the oldest one on the first sibling deque that has any. Empty
+ * deques are skipped without taking their lock.
+ *
+ * Params:	deque:	The worker's home deque
+ * 			t:		Where the task is stored
+ * Returns:	false if every deque was empty
+ *********************************************************************/
+bool takeTask(int deque, struct task *t){
+	struct taskDeque *d = &taskPool->deques[deque];
+	bool found = false;
+	pthread_mutex_lock(&d->lock);
+	if(d->bottom != d->top){
+		*t = d->tasks[(d->bottom - 1) % TASK_DEQUE_SIZE];
+		__atomic_store_n(&d->bottom, d->bottom - 1, __ATOMIC_RELEASE);
+		found = true;
+	}
+	pthread_mutex_unlock(&d->lock);
+
+	int i;
+	for(i = 1; i < TASK_DEQUES && !found; i++){
+		struct taskDeque *victim = &taskPool->deques[(deque + i) % TASK_DEQUES];
+		if(__atomic_load_n(&victim->bottom, __ATOMIC_ACQUIRE) == __atomic_load_n(&victim->top, __ATOMIC_ACQUIRE)){
+			continue;
+		}
+		pthread_mutex_lock(&victim->lock);
+		if(victim->bottom != victim->top){
+			*t = victim->tasks[victim->top % TASK_DEQUE_SIZE];
+			__atomic_store_n(&victim->top, victim->top + 1, __ATOMIC_RELEASE);
+			found = true;
+		}
+		pthread_mutex_unlock(&victim->lock);
+		if(found){
+			__atomic_add_fetch(&d->stolen, 1, __ATOMIC_RELAXED);
+		}
+	}
+	return found;
+}
+
+
+/**********************************************************************
+ * Runs tasks until the worker is stopped. A process worker is stopped
+ * by SIGINT, which is held off while it has a task; a thread worker
+ * by threadStop. An idle worker wakes every HEARTBEAT_MS to beat.
+ *
+ * Params:	deque:	The worker's home deque
+ * 			w:		The worker record for a thread worker, NULL in
+ * 					a worker process
+ *********************************************************************/
+void runTasks(int deque, struct worker *w){
+	struct taskDeque *home = &taskPool->deques[deque];
+	struct workerSlot *own = ownSlot(w);
+	static const struct timespec pause = {0, 50000};
+	while(1){
+		heartbeat(w);
+		//sem_timedwait only takes CLOCK_REALTIME; a clock step just
+		//makes one beat early or late
+		struct timespec until;
+		clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_nsec += HEARTBEAT_MS * 1000000L;
+		if(until.tv_nsec >= 1000000000L){
+			until.tv_sec++;
+			until.tv_nsec -= 1000000000L;
+		}
+		int rc = sem_timedwait(&taskPool->pending, &until);
+		if(w == NULL){
+			taskBusy = 1;
+		}
+		if(w != NULL && __atomic_load_n(&w->stopping, __ATOMIC_ACQUIRE)){
+			if(rc == 0){
+				__atomic_sub_fetch(&taskPool->stopsPending, 1, __ATOMIC_RELAXED);
+			}
+			else{
+				while(sem_wait(&taskPool->pending) != 0);
+				__atomic_sub_fetch(&taskPool->stopsPending, 1, __ATOMIC_RELAXED);
+			}
+			return;
+		}
+		if(rc == 0){
+			struct task t;
+			if(takeTask(deque, &t)){
+				if(own != NULL){
+					__atomic_store_n(&own->busy, 1, __ATOMIC_RELAXED);
+				}
+				runTask(home, &t);
+				if(own != NULL){
+					__atomic_store_n(&own->busy, 0, __ATOMIC_RELAXED);
+				}
+			}
+			else if(__atomic_load_n(&taskPool->stopsPending, __ATOMIC_RELAXED) > 0){
+				//the wakeup was meant for a stopping thread
+				sem_post(&taskPool->pending);
+				nanosleep(&pause, NULL);
+			}
+		}
+		if(w != NULL){
+			continue;
+		}
+		taskBusy = 0;
+		if(stopRequested){
+			static const char msg[] = "I am exiting.\n";
+			if(write(STDOUT_FILENO, msg, sizeof(msg) - 1) < 0){
+				_exit(1);
+			}
+			_exit(0);
+		}
+	}
+}
+
+
+/**********************************************************************
+ * Finds the status slot a worker writes its own beats and busy flag
+ * to: beatSlot in a worker process, its record's slot for a thread
+ *
+ * Params:	w:	The worker record for a thread worker, NULL in a
+ * 				worker process
+ * Returns:	The slot, or NULL if it has none
+ *********************************************************************/
+struct workerSlot *ownSlot(struct worker *w){
+	if(w == NULL){
+		return beatSlot;
+	}
+	return w->slot >= 0 ? &status->workers[w->slot] : NULL;
+}
+
+
+/**********************************************************************
+ * Bumps a worker's heartbeat
+ *
+ * Params:	w:	The worker record for a thread worker, NULL in a
+ * 				worker process
+ *********************************************************************/
+void heartbeat(struct worker *w){
+	struct workerSlot *slot = ownSlot(w);
+	if(slot != NULL){
+		__atomic_add_fetch(&slot->beats, 1, __ATOMIC_RELAXED);
+	}
+}
+
+
+/**********************************************************************
+ * Maps the worker slots of the status table into a spawn worker,
+ * which does not inherit the server's mapping, and points beatSlot at
+ * its own. A worker that cannot map it never beats, and is replaced
+ * as hung once it is active.
+ *
+ * Params:	name:	The table's shared memory name
+ * 			slot:	The worker's slot
+ *********************************************************************/
+void mapBeatSlot(const char *name, int slot){
+	int fd = shm_open(name, O_RDWR | O_CLOEXEC, 0);
+	if(fd < 0){
+		return;
+	}
+	//the worker slots sit in front of the growable server slots
+	struct statusTable *table = mmap(NULL, sizeof(struct statusTable), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(table != MAP_FAILED){
+		beatSlot = &table->workers[slot];
+	}
+}
+
+
+/**********************************************************************
+ * Runs one task: the worker spins for the task's cost, standing in
+ * for real CPU-bound work
+ *
+ * Params:	home:	The worker's home deque, where it is counted
+ * 			t:		The task
+ *********************************************************************/
+void runTask(struct taskDeque *home, const struct task *t){
+	__atomic_add_fetch(&home->running, 1, __ATOMIC_RELAXED);
+	unsigned long long end = nowNanos() + t->costUsec * 1000ULL;
+	while(nowNanos() < end);
+	__atomic_sub_fetch(&home->running, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&home->done, 1, __ATOMIC_RELAXED);
+}
+
+
+/**********************************************************************
+ * Sums the task pool's counters
+ *
+ * Params:	queued:		Where the number of queued tasks is stored
+ * 			running:	Where the number of running tasks is stored
+ * 			done:		Where the number of finished tasks is stored
+ * 			stolen:		Where the number of stolen tasks is stored
+ *********************************************************************/
+void countTasks(int *queued, int *running, unsigned long long *done, unsigned long long *stolen){
+	*queued = *running = 0;
+	*done = *stolen = 0;
+	if(taskPool == NULL){
+		return;
+	}
+	int i;
+	for(i = 0; i < TASK_DEQUES; i++){
+		struct taskDeque *d = &taskPool->deques[i];
+		*queued += __atomic_load_n(&d->bottom, __ATOMIC_RELAXED) - __atomic_load_n(&d->top, __ATOMIC_RELAXED);
+		*running += __atomic_load_n(&d->running, __ATOMIC_RELAXED);
+		*done += __atomic_load_n(&d->done, __ATOMIC_RELAXED);
+		*stolen += __atomic_load_n(&d->stolen, __ATOMIC_RELAXED);
+	}
+}
+
+
+/**********************************************************************
+ * Returns the tasks queued on or running from a deque, which is a
+ * worker's in-flight work when it has the deque to itself
+ *
+ * Params:	deque:	The deque index
+ *********************************************************************/
+int dequeInflight(int deque){
+	if(taskPool == NULL){
+		return 0;
+	}
+	struct taskDeque *d = &taskPool->deques[deque];
+	return (int)(__atomic_load_n(&d->bottom, __ATOMIC_RELAXED) - __atomic_load_n(&d->top, __ATOMIC_RELAXED))
+			+ __atomic_load_n(&d->running, __ATOMIC_RELAXED);
+}
+
+
+/**********************************************************************
+ * Posts a wakeup for queued tasks that have none. A worker killed
+ * between sem_wait and taking its task leaves one behind; any extra
+ * wakeup posted here is dropped by whoever finds nothing.
+ *********************************************************************/
+void wakeOrphans(){
+	int queued, running, value;
+	unsigned long long done, stolen;
+	countTasks(&queued, &running, &done, &stolen);
+	if(queued > 0 && sem_getvalue(&taskPool->pending, &value) == 0 && value == 0){
+		sem_post(&taskPool->pending);
+	}
 }